@@ -4,7 +4,23 @@
 #include "libnullnexus/nullnexus.hpp"
 #include <iostream>
 
-void msg(std::string username, std::string msg, int colour)
+#ifdef BOOST_NO_EXCEPTIONS
+// Required by boost when building with NULLNEXUS_NO_EXCEPTIONS
+namespace boost
+{
+void throw_exception(std::exception const &e)
+{
+    std::cerr << e.what() << std::endl;
+    std::abort();
+}
+void throw_exception(std::exception const &e, boost::source_location const &)
+{
+    throw_exception(e);
+}
+} // namespace boost
+#endif
+
+void msg(std::string username, std::string msg, [[maybe_unused]] int colour)
 {
     std::cout << username << " " << msg << std::endl;
 }
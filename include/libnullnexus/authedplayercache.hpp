@@ -0,0 +1,85 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Least recently used cache of authed player lists, keyed by game server.
+// Lets a client that comes back to a server use the last known list while the fresh one is still on its way.
+// Safe to use from multiple threads.
+class AuthedPlayerCache
+{
+public:
+    using Snapshot = std::shared_ptr<const std::vector<std::string>>;
+
+private:
+    struct Entry
+    {
+        std::string key;
+        Snapshot steamids;
+    };
+
+    std::mutex mutex;
+    std::size_t capacity;
+    // Most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+public:
+    AuthedPlayerCache(std::size_t capacity = 16) : capacity(capacity)
+    {
+    }
+
+    void put(const std::string &key, std::vector<std::string> steamids)
+    {
+        if (capacity == 0)
+            return;
+        auto snapshot = std::make_shared<const std::vector<std::string>>(std::move(steamids));
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            it->second->steamids = snapshot;
+            entries.splice(entries.begin(), entries, it->second);
+            return;
+        }
+        if (entries.size() >= capacity)
+        {
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+        entries.push_front(Entry{ key, snapshot });
+        index.emplace(key, entries.begin());
+    }
+
+    // Marks the entry as recently used
+    Snapshot get(const std::string &key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end())
+            return nullptr;
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->steamids;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        index.clear();
+    }
+
+    std::size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+};
@@ -0,0 +1,166 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Fixed capacity ring buffer of received chat messages.
+// All memory is allocated up front: every entry owns a fixed size slot in a single slab holding its strings,
+// longer strings are truncated (on a UTF-8 boundary). Once full, the oldest entry is overwritten.
+// Safe to use from multiple threads, the views handed to visitors are only valid during the visitor call.
+class ChatHistory
+{
+public:
+    // Per entry string limits
+    static constexpr std::size_t MAX_USER = 64;
+    static constexpr std::size_t MAX_MSG  = 256;
+    static constexpr std::size_t MAX_LOC  = 32;
+
+    struct EntryView
+    {
+        std::string_view user, msg, loc;
+        int colour;
+        std::chrono::system_clock::time_point timestamp;
+    };
+
+    // Owning copy of an entry
+    struct Entry
+    {
+        std::string user, msg, loc;
+        int colour;
+        std::chrono::system_clock::time_point timestamp;
+    };
+
+private:
+    static constexpr std::size_t SLOT_SIZE = MAX_USER + MAX_MSG + MAX_LOC;
+
+    struct Meta
+    {
+        std::chrono::system_clock::time_point timestamp;
+        int colour;
+        std::uint16_t user_len, msg_len, loc_len;
+    };
+
+    std::size_t cap;
+    std::vector<Meta> meta;
+    std::vector<char> slab;
+    // Index of the oldest entry and amount of entries stored
+    std::size_t head  = 0;
+    std::size_t count = 0;
+    mutable std::shared_mutex mutex;
+
+    // Cut s to at most max bytes without splitting a UTF-8 sequence
+    static std::string_view fit(std::string_view s, std::size_t max)
+    {
+        if (s.size() <= max)
+            return s;
+        std::size_t len = max;
+        while (len > 0 && (static_cast<unsigned char>(s[len]) & 0xC0) == 0x80)
+            len--;
+        return s.substr(0, len);
+    }
+
+    EntryView view(std::size_t index) const
+    {
+        const Meta &m    = meta[index];
+        const char *slot = slab.data() + index * SLOT_SIZE;
+        return { { slot, m.user_len }, { slot + MAX_USER, m.msg_len }, { slot + MAX_USER + MAX_MSG, m.loc_len }, m.colour, m.timestamp };
+    }
+
+    // Physical index of the i-th oldest entry
+    std::size_t physical(std::size_t i) const
+    {
+        return (head + i) % cap;
+    }
+
+public:
+    ChatHistory(std::size_t capacity) : cap(capacity ? capacity : 1), meta(cap), slab(cap * SLOT_SIZE)
+    {
+    }
+
+    void push(std::string_view user, std::string_view msg, std::string_view loc, int colour, std::chrono::system_clock::time_point timestamp = std::chrono::system_clock::now())
+    {
+        user = fit(user, MAX_USER);
+        msg  = fit(msg, MAX_MSG);
+        loc  = fit(loc, MAX_LOC);
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::size_t index;
+        if (count < cap)
+            index = physical(count++);
+        else
+        {
+            // Overwrite oldest
+            index = head;
+            head  = (head + 1) % cap;
+        }
+        char *slot = slab.data() + index * SLOT_SIZE;
+        std::memcpy(slot, user.data(), user.size());
+        std::memcpy(slot + MAX_USER, msg.data(), msg.size());
+        std::memcpy(slot + MAX_USER + MAX_MSG, loc.data(), loc.size());
+        meta[index] = { timestamp, colour, std::uint16_t(user.size()), std::uint16_t(msg.size()), std::uint16_t(loc.size()) };
+    }
+
+    void clear()
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        head  = 0;
+        count = 0;
+    }
+
+    std::size_t size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return count;
+    }
+
+    std::size_t capacity() const
+    {
+        return cap;
+    }
+
+    // Visit the newest n entries, oldest first
+    template <typename F> void forEachLast(std::size_t n, F visitor) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        std::size_t start = count > n ? count - n : 0;
+        for (std::size_t i = start; i < count; i++)
+        {
+            const EntryView entry = view(physical(i));
+            visitor(entry);
+        }
+    }
+
+    // Visit all entries sent by user, oldest first
+    template <typename F> void forEachFromUser(std::string_view user, F visitor) const
+    {
+        user = fit(user, MAX_USER);
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for (std::size_t i = 0; i < count; i++)
+        {
+            std::size_t index = physical(i);
+            if (meta[index].user_len != user.size())
+                continue;
+            const EntryView entry = view(index);
+            if (entry.user == user)
+                visitor(entry);
+        }
+    }
+
+    // Copy of the newest n entries, oldest first
+    std::vector<Entry> last(std::size_t n) const
+    {
+        std::vector<Entry> ret;
+        forEachLast(n, [&](const EntryView &entry) { ret.push_back({ std::string(entry.user), std::string(entry.msg), std::string(entry.loc), entry.colour, entry.timestamp }); });
+        return ret;
+    }
+};
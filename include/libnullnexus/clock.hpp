@@ -0,0 +1,149 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+
+namespace net = boost::asio; // from <boost/asio.hpp>
+
+/*
+ * Clocks used by BasicWebSocketClient for its timers.
+ *
+ * A clock is a std::chrono clock with an additional nested timer type, constructible from an io_context and offering
+ * expires_after(duration), async_wait(handler(const boost::system::error_code &)) and cancel() like net::steady_timer.
+ */
+
+// Monotonic real time
+struct SteadyClock : std::chrono::steady_clock
+{
+    using timer = net::steady_timer;
+};
+
+// Virtual time for tests, only moves when advance() is called.
+// Timers that become due are completed right away by posting their handlers to their io_context,
+// so hours of reconnect delays can be simulated without waiting for them.
+class SimulatedClock
+{
+public:
+    using duration                  = std::chrono::nanoseconds;
+    using rep                       = duration::rep;
+    using period                    = duration::period;
+    using time_point                = std::chrono::time_point<SimulatedClock>;
+    static constexpr bool is_steady = true;
+
+    class timer;
+
+private:
+    struct State
+    {
+        std::mutex mutex;
+        time_point now;
+        std::set<timer *> waiting;
+    };
+    static State &state()
+    {
+        static State instance;
+        return instance;
+    }
+
+public:
+    class timer
+    {
+        friend class SimulatedClock;
+
+        net::io_context &ioc;
+        time_point expiry;
+        std::function<void(const boost::system::error_code &)> handler;
+
+        // Needs the state mutex to be held
+        void complete(const boost::system::error_code &ec)
+        {
+            if (!handler)
+                return;
+            net::post(ioc, std::bind(std::move(handler), ec));
+            handler = nullptr;
+            state().waiting.erase(this);
+        }
+
+    public:
+        timer(net::io_context &ioc) : ioc(ioc)
+        {
+        }
+        timer(const timer &) = delete;
+        ~timer()
+        {
+            // Pending handlers are dropped, like they are when an io_context is destroyed
+            std::lock_guard<std::mutex> lock(state().mutex);
+            state().waiting.erase(this);
+        }
+
+        // Cancels a pending wait
+        void expires_after(duration d)
+        {
+            std::lock_guard<std::mutex> lock(state().mutex);
+            complete(net::error::operation_aborted);
+            expiry = state().now + d;
+        }
+
+        template <typename Handler> void async_wait(Handler &&wait_handler)
+        {
+            std::lock_guard<std::mutex> lock(state().mutex);
+            complete(net::error::operation_aborted);
+            handler = std::forward<Handler>(wait_handler);
+            state().waiting.insert(this);
+            if (expiry <= state().now)
+                complete({});
+        }
+
+        void cancel()
+        {
+            std::lock_guard<std::mutex> lock(state().mutex);
+            complete(net::error::operation_aborted);
+        }
+    };
+
+    static time_point now()
+    {
+        std::lock_guard<std::mutex> lock(state().mutex);
+        return state().now;
+    }
+
+    // Move time forward, completing every timer that becomes due in order of expiry.
+    // Handlers run on their io_context afterwards, timers they set up inside the skipped interval fire on the next advance().
+    static void advance(duration d)
+    {
+        std::lock_guard<std::mutex> lock(state().mutex);
+        auto &s = state();
+        s.now += d;
+        std::multimap<time_point, timer *> due;
+        for (auto *t : s.waiting)
+            if (t->expiry <= s.now)
+                due.emplace(t->expiry, t);
+        for (auto &entry : due)
+            entry.second->complete({});
+    }
+
+    // Timers currently waiting. Lets tests wait until the code under test is idle before moving time.
+    static std::size_t pendingTimers()
+    {
+        std::lock_guard<std::mutex> lock(state().mutex);
+        return state().waiting.size();
+    }
+
+    // Back to the epoch, for starting a new scenario. Should only be called without any pending timers.
+    static void reset()
+    {
+        std::lock_guard<std::mutex> lock(state().mutex);
+        state().now = time_point();
+    }
+};
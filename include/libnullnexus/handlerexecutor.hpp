@@ -0,0 +1,237 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "threadoptions.hpp"
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio; // from <boost/asio.hpp>
+
+/*
+ * Small thread pool for user callbacks, so a slow handler can't stall reading, pinging and reconnecting on the IO thread.
+ *
+ * Work is posted to a lane identified by a key. Work within a lane runs one at a time in the order it was posted,
+ * different lanes may run in parallel when there is more than one thread.
+ * Every piece of work is timed, running longer than the budget is counted in the lane's stats and reported to the over budget handler.
+ * A watchdog thread looks at the work still running, so a handler that hangs is reported as well.
+ */
+class HandlerExecutor
+{
+public:
+    struct Stats
+    {
+        std::uint64_t executed    = 0;
+        std::uint64_t over_budget = 0;
+        std::chrono::nanoseconds longest{};
+    };
+
+private:
+    using strand_type = net::strand<net::io_context::executor_type>;
+
+    struct Lane
+    {
+        strand_type strand;
+        Stats stats;
+        // Work running right now, and whether it was reported already
+        std::optional<std::chrono::steady_clock::time_point> running_since;
+        bool reported = false;
+
+        explicit Lane(strand_type strand) : strand(strand)
+        {
+        }
+    };
+
+    net::io_context ioc;
+    net::executor_work_guard<net::io_context::executor_type> work;
+    std::vector<std::thread> threads;
+    std::chrono::nanoseconds budget;
+
+    std::mutex mutex;
+    // Lanes never go away, so references to them stay valid
+    std::map<std::string, Lane, std::less<>> lanes;
+    std::function<void(std::string_view key, std::chrono::nanoseconds took)> on_over_budget;
+
+    // Watchdog, and the deadline it sleeps until (none while no work is running)
+    std::thread watchdog;
+    std::condition_variable watchdog_wakeup;
+    std::optional<std::chrono::steady_clock::time_point> watchdog_deadline;
+    bool stopping = false;
+
+    Lane &lane(std::string_view key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = lanes.find(key);
+        if (it == lanes.end())
+            it = lanes.emplace(std::string(key), net::make_strand(ioc)).first;
+        return it->second;
+    }
+
+    void run(const std::string &key, Lane &lane, const std::function<void()> &fn)
+    {
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            lane.running_since = start;
+            lane.reported      = false;
+            // Work started later is due later, so the watchdog only needs to hear about it when it has nothing to wait for
+            if (!watchdog_deadline)
+                watchdog_wakeup.notify_one();
+        }
+        fn();
+        auto took = std::chrono::steady_clock::now() - start;
+
+        std::function<void(std::string_view, std::chrono::nanoseconds)> report;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            lane.running_since.reset();
+            if (watchdog_deadline == start + budget)
+                watchdog_wakeup.notify_one();
+            lane.stats.executed++;
+            lane.stats.longest = std::max<std::chrono::nanoseconds>(lane.stats.longest, took);
+            // The watchdog got to it first
+            if (took <= budget || lane.reported)
+                return;
+            lane.stats.over_budget++;
+            report = on_over_budget;
+        }
+        if (report)
+            report(key, took);
+    }
+
+    // Report work that is still running past the budget, once per piece of work.
+    // Sleeps until the earliest running work is due, or until work starts while none is running.
+    void runWatchdog()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping)
+        {
+            auto now = std::chrono::steady_clock::now();
+            std::vector<std::pair<std::string, std::chrono::nanoseconds>> overdue;
+            watchdog_deadline.reset();
+            for (auto &entry : lanes)
+            {
+                auto &lane = entry.second;
+                if (!lane.running_since || lane.reported)
+                    continue;
+                if (now - *lane.running_since <= budget)
+                {
+                    auto due          = *lane.running_since + budget;
+                    watchdog_deadline = watchdog_deadline ? std::min(*watchdog_deadline, due) : due;
+                    continue;
+                }
+                lane.reported = true;
+                lane.stats.over_budget++;
+                overdue.emplace_back(entry.first, now - *lane.running_since);
+            }
+            if (!overdue.empty() && on_over_budget)
+            {
+                auto report = on_over_budget;
+                // Work may start in the meantime, have it wake us
+                watchdog_deadline.reset();
+                lock.unlock();
+                for (auto &item : overdue)
+                    report(item.first, item.second);
+                lock.lock();
+                continue;
+            }
+            if (watchdog_deadline)
+                watchdog_wakeup.wait_until(lock, *watchdog_deadline);
+            else
+                watchdog_wakeup.wait(lock);
+        }
+    }
+
+    static ThreadOptions defaultThreadOptions()
+    {
+        ThreadOptions options;
+        options.name = "nullnexus-cb";
+        return options;
+    }
+
+public:
+    HandlerExecutor(std::size_t thread_count = 1, std::chrono::nanoseconds budget = std::chrono::milliseconds(50), ThreadOptions thread_options = defaultThreadOptions()) : work(ioc.get_executor()), budget(budget)
+    {
+        for (std::size_t i = 0; i < std::max<std::size_t>(thread_count, 1); i++)
+            threads.emplace_back([this, thread_options]() {
+                thread_options.apply();
+                ioc.run();
+            });
+        watchdog = std::thread(&HandlerExecutor::runWatchdog, this);
+    }
+    HandlerExecutor(const HandlerExecutor &) = delete;
+
+    // Queue fn on the lane named key
+    void post(std::string_view key, std::function<void()> fn)
+    {
+        auto &target = lane(key);
+        net::post(target.strand, [this, key = std::string(key), &target, fn = std::move(fn)]() { run(key, target, fn); });
+    }
+
+    // Block until everything posted so far has run. Must not be called from a handler.
+    void wait()
+    {
+        std::vector<std::future<void>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto &entry : lanes)
+            {
+                auto done = std::make_shared<std::promise<void>>();
+                pending.push_back(done->get_future());
+                net::post(entry.second.strand, [done]() { done->set_value(); });
+            }
+        }
+        for (auto &future : pending)
+            future.wait();
+    }
+
+    // Called when a handler runs longer than the budget, once per handler call. Usually by the watchdog thread while the handler
+    // is still running, took is how long it ran so far then. Otherwise on the executor thread right after it, with the full time.
+    void setOverBudgetHandler(std::function<void(std::string_view key, std::chrono::nanoseconds took)> handler)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        on_over_budget = handler;
+    }
+
+    std::map<std::string, Stats> stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<std::string, Stats> out;
+        for (auto &entry : lanes)
+            out.emplace(entry.first, entry.second.stats);
+        return out;
+    }
+
+    ~HandlerExecutor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        watchdog_wakeup.notify_all();
+        watchdog.join();
+        work.reset();
+        for (auto &thread : threads)
+            thread.join();
+    }
+};
@@ -0,0 +1,180 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Live websocket session taken out of a client (see BasicWebSocketClient::detach), to be adopted by another client
+ * without reconnecting, e.g. by the new instance after a module reload.
+ *
+ * Within the same process the descriptor stays valid and the handoff can be passed as is, or as an encoded blob.
+ * To hand it to another process, send it over a unix socket: the descriptor goes along as SCM_RIGHTS.
+ */
+struct SessionHandoff
+{
+    // Connected socket, owned by whoever holds the handoff
+    int fd = -1;
+    // Received from the server but not handled yet, starts at a message boundary
+    std::string pending_input;
+    // Messages queued for sending while offline
+    std::vector<std::string> queued_messages;
+    // Anything the owner of the client wants to carry over (e.g. NullNexus settings)
+    std::string user_data;
+
+    // Blob with all fields, including the descriptor number (only meaningful in the same process)
+    std::string encode() const
+    {
+        std::string out = "NNH1";
+        putInt(out, std::uint32_t(fd));
+        putString(out, pending_input);
+        putInt(out, std::uint32_t(queued_messages.size()));
+        for (auto &msg : queued_messages)
+            putString(out, msg);
+        putString(out, user_data);
+        return out;
+    }
+
+    // Null if data is not a complete handoff
+    static std::optional<SessionHandoff> decode(std::string_view data)
+    {
+        if (data.substr(0, 4) != "NNH1")
+            return std::nullopt;
+        data.remove_prefix(4);
+        SessionHandoff handoff;
+        std::uint32_t fd, count;
+        if (!getInt(data, fd) || !getString(data, handoff.pending_input) || !getInt(data, count))
+            return std::nullopt;
+        handoff.fd = int(fd);
+        for (std::uint32_t i = 0; i < count; i++)
+        {
+            std::string msg;
+            if (!getString(data, msg))
+                return std::nullopt;
+            handoff.queued_messages.push_back(std::move(msg));
+        }
+        if (!getString(data, handoff.user_data) || !data.empty())
+            return std::nullopt;
+        return handoff;
+    }
+
+#ifdef __linux__
+    // Send over a connected unix socket. The descriptor is duplicated into the receiver, ours still has to be closed.
+    bool send(int channel) const
+    {
+        std::string blob   = encode();
+        std::uint32_t size = blob.size();
+
+        // The size goes first and carries the descriptor
+        iovec iov{ &size, sizeof(size) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr msg{};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr *cmsg      = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level   = SOL_SOCKET;
+        cmsg->cmsg_type    = SCM_RIGHTS;
+        cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        if (::sendmsg(channel, &msg, MSG_NOSIGNAL) != sizeof(size))
+            return false;
+
+        for (std::size_t sent = 0; sent < blob.size();)
+        {
+            auto result = ::send(channel, blob.data() + sent, blob.size() - sent, MSG_NOSIGNAL);
+            if (result <= 0)
+                return false;
+            sent += result;
+        }
+        return true;
+    }
+
+    // Receive what send() sent on the other end, blocks until it is complete
+    static std::optional<SessionHandoff> receive(int channel)
+    {
+        std::uint32_t size = 0;
+        iovec iov{ &size, sizeof(size) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr msg{};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(channel, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(size))
+            return std::nullopt;
+        int fd        = -1;
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        if (fd < 0)
+            return std::nullopt;
+
+        std::string blob(size, '\0');
+        for (std::size_t received = 0; received < blob.size();)
+        {
+            auto result = ::recv(channel, blob.data() + received, blob.size() - received, 0);
+            if (result <= 0)
+            {
+                ::close(fd);
+                return std::nullopt;
+            }
+            received += result;
+        }
+        auto handoff = decode(blob);
+        if (!handoff)
+        {
+            ::close(fd);
+            return std::nullopt;
+        }
+        // The number the sender had means nothing here
+        handoff->fd = fd;
+        return handoff;
+    }
+#endif
+
+private:
+    static void putInt(std::string &out, std::uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+            out.push_back(char((value >> (i * 8)) & 0xFF));
+    }
+    static void putString(std::string &out, std::string_view value)
+    {
+        putInt(out, std::uint32_t(value.size()));
+        out.append(value);
+    }
+    static bool getInt(std::string_view &in, std::uint32_t &value)
+    {
+        if (in.size() < 4)
+            return false;
+        value = 0;
+        for (int i = 0; i < 4; i++)
+            value |= std::uint32_t((unsigned char) in[i]) << (i * 8);
+        in.remove_prefix(4);
+        return true;
+    }
+    static bool getString(std::string_view &in, std::string &value)
+    {
+        std::uint32_t size;
+        if (!getInt(in, size) || in.size() < size)
+            return false;
+        value.assign(in.substr(0, size));
+        in.remove_prefix(size);
+        return true;
+    }
+};
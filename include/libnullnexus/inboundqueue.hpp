@@ -0,0 +1,128 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// What a full InboundQueue does with another message
+enum class InboundOverflow
+{
+    // Make room by discarding the message that waited longest
+    DropOldest,
+    // Discard the new message
+    DropNewest
+};
+
+struct InboundOptions
+{
+    // Messages waiting per queue
+    std::size_t capacity     = 1024;
+    InboundOverflow overflow = InboundOverflow::DropOldest;
+};
+
+/*
+ * Bounded, thread safe message queue between the IO thread and a slower consumer.
+ *
+ * Messages pushed with a conflation key replace a waiting message with the same key in place,
+ * so for state like "the current player list" only the latest value is ever handled.
+ * The queue also tracks whether a consumer is scheduled: push() tells the producer when one has to be started
+ * and pop() ends the schedule once the queue ran empty.
+ */
+class InboundQueue
+{
+    struct Entry
+    {
+        std::string key;
+        std::string msg;
+    };
+
+    std::mutex mutex;
+    InboundOptions options;
+    std::deque<Entry> entries;
+    // Waiting conflatable messages by key, deque references stay valid while pushing and popping at the ends
+    std::unordered_map<std::string, Entry *> by_key;
+    bool scheduled        = false;
+    std::uint64_t dropped = 0;
+
+    // Needs the mutex to be held
+    void popFront()
+    {
+        if (!entries.front().key.empty())
+            by_key.erase(entries.front().key);
+        entries.pop_front();
+    }
+
+public:
+    void setOptions(InboundOptions new_options)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        options = new_options;
+        while (entries.size() > options.capacity)
+        {
+            popFront();
+            dropped++;
+        }
+    }
+
+    // Queue msg, an empty key means no conflation.
+    // Returns true if no consumer is scheduled, the caller has to start one then.
+    bool push(std::string msg, std::string key = std::string())
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!key.empty())
+        {
+            auto it = by_key.find(key);
+            if (it != by_key.end())
+            {
+                it->second->msg = std::move(msg);
+                return false;
+            }
+        }
+        if (entries.size() >= options.capacity)
+        {
+            dropped++;
+            if (options.overflow == InboundOverflow::DropNewest || entries.empty())
+                return false;
+            popFront();
+        }
+        entries.push_back(Entry{ key, std::move(msg) });
+        if (!key.empty())
+            by_key.emplace(std::move(key), &entries.back());
+        bool start = !scheduled;
+        scheduled  = true;
+        return start;
+    }
+
+    // Take the next message. Returns false once the queue is empty, the consumer is no longer scheduled from then on.
+    bool pop(std::string &msg)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entries.empty())
+        {
+            scheduled = false;
+            return false;
+        }
+        msg = std::move(entries.front().msg);
+        popFront();
+        return true;
+    }
+
+    std::size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    // Messages discarded because the queue was full
+    std::uint64_t droppedCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dropped;
+    }
+};
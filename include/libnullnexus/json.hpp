@@ -0,0 +1,368 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Non-throwing JSON codec. The decoder produces the same tree layout as boost::property_tree::read_json:
+// objects become keyed children, arrays become children with empty keys and all values are stored as strings.
+// Malformed input is reported through the return value instead of an exception, so it is safe to use with -fno-exceptions.
+class JsonCodec
+{
+    // Nesting limit, protects the stack against hostile input
+    static constexpr int MAX_DEPTH = 64;
+
+    std::string_view in;
+    std::size_t pos = 0;
+
+    JsonCodec(std::string_view in) : in(in)
+    {
+    }
+
+    void skipWhitespace()
+    {
+        while (pos < in.size() && (in[pos] == ' ' || in[pos] == '\t' || in[pos] == '\n' || in[pos] == '\r'))
+            pos++;
+    }
+
+    bool consume(char c)
+    {
+        skipWhitespace();
+        if (pos >= in.size() || in[pos] != c)
+            return false;
+        pos++;
+        return true;
+    }
+
+    static void appendUtf8(std::string &out, unsigned long cp)
+    {
+        if (cp < 0x80)
+            out += char(cp);
+        else if (cp < 0x800)
+        {
+            out += char(0xC0 | (cp >> 6));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            out += char(0xE0 | (cp >> 12));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += char(0xF0 | (cp >> 18));
+            out += char(0x80 | ((cp >> 12) & 0x3F));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+    }
+
+    bool parseHex4(unsigned long &out)
+    {
+        if (pos + 4 > in.size())
+            return false;
+        out = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char c = in[pos++];
+            out <<= 4;
+            if (c >= '0' && c <= '9')
+                out |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                out |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                out |= c - 'A' + 10;
+            else
+                return false;
+        }
+        return true;
+    }
+
+    bool parseString(std::string &out)
+    {
+        if (!consume('"'))
+            return false;
+        while (pos < in.size())
+        {
+            char c = in[pos++];
+            if (c == '"')
+                return true;
+            if ((unsigned char) c < 0x20)
+                return false;
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos >= in.size())
+                return false;
+            switch (in[pos++])
+            {
+            case '"':
+                out += '"';
+                break;
+            case '\\':
+                out += '\\';
+                break;
+            case '/':
+                out += '/';
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u':
+            {
+                unsigned long cp;
+                if (!parseHex4(cp))
+                    return false;
+                // Surrogate pair
+                if (cp >= 0xD800 && cp <= 0xDBFF)
+                {
+                    unsigned long low;
+                    if (pos + 2 > in.size() || in[pos] != '\\' || in[pos + 1] != 'u')
+                        return false;
+                    pos += 2;
+                    if (!parseHex4(low) || low < 0xDC00 || low > 0xDFFF)
+                        return false;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(out, cp);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool parseLiteral(std::string_view literal, boost::property_tree::ptree &out)
+    {
+        if (in.substr(pos, literal.size()) != literal)
+            return false;
+        pos += literal.size();
+        out.data() = std::string(literal);
+        return true;
+    }
+
+    bool parseNumber(boost::property_tree::ptree &out)
+    {
+        std::size_t start = pos;
+        auto digits       = [&]() {
+            std::size_t begin = pos;
+            while (pos < in.size() && in[pos] >= '0' && in[pos] <= '9')
+                pos++;
+            return pos != begin;
+        };
+        if (pos < in.size() && in[pos] == '-')
+            pos++;
+        if (!digits())
+            return false;
+        if (pos < in.size() && in[pos] == '.')
+        {
+            pos++;
+            if (!digits())
+                return false;
+        }
+        if (pos < in.size() && (in[pos] == 'e' || in[pos] == 'E'))
+        {
+            pos++;
+            if (pos < in.size() && (in[pos] == '+' || in[pos] == '-'))
+                pos++;
+            if (!digits())
+                return false;
+        }
+        out.data() = std::string(in.substr(start, pos - start));
+        return true;
+    }
+
+    bool parseValue(boost::property_tree::ptree &out, int depth)
+    {
+        if (depth > MAX_DEPTH)
+            return false;
+        skipWhitespace();
+        if (pos >= in.size())
+            return false;
+        switch (in[pos])
+        {
+        case '{':
+        {
+            pos++;
+            if (consume('}'))
+                return true;
+            do
+            {
+                std::string key;
+                skipWhitespace();
+                if (!parseString(key) || !consume(':'))
+                    return false;
+                auto &child = out.push_back({ key, boost::property_tree::ptree() })->second;
+                if (!parseValue(child, depth + 1))
+                    return false;
+            } while (consume(','));
+            return consume('}');
+        }
+        case '[':
+        {
+            pos++;
+            if (consume(']'))
+                return true;
+            do
+            {
+                auto &child = out.push_back({ "", boost::property_tree::ptree() })->second;
+                if (!parseValue(child, depth + 1))
+                    return false;
+            } while (consume(','));
+            return consume(']');
+        }
+        case '"':
+            return parseString(out.data());
+        case 't':
+            return parseLiteral("true", out);
+        case 'f':
+            return parseLiteral("false", out);
+        case 'n':
+            return parseLiteral("null", out);
+        default:
+            return parseNumber(out);
+        }
+    }
+
+    // Read a string token starting at pos (which points at the opening quote) without decoding it
+    bool scanString(std::string_view &raw, bool &escaped)
+    {
+        std::size_t start = ++pos;
+        escaped           = false;
+        while (pos < in.size())
+        {
+            if (in[pos] == '\\')
+            {
+                escaped = true;
+                pos += 2;
+                continue;
+            }
+            if (in[pos] == '"')
+            {
+                raw = in.substr(start, pos - start);
+                pos++;
+                return true;
+            }
+            pos++;
+        }
+        return false;
+    }
+
+public:
+    // Cheaply find the first member named key with a string value, without building a tree.
+    // depth selects the nesting level of the member: 1 for members of the top level object, 2 for members of its children and so on.
+    // Only whole string tokens are matched, so text inside other strings can't produce false hits.
+    // Returns nullopt if there is no such member or the value contains escapes and would need decoding.
+    static std::optional<std::string_view> peekString(std::string_view json, std::string_view key, int depth = 1)
+    {
+        JsonCodec codec(json);
+        int level = 0;
+        while (codec.pos < json.size())
+        {
+            char c = json[codec.pos];
+            if (c != '"')
+            {
+                if (c == '{' || c == '[')
+                    level++;
+                else if (c == '}' || c == ']')
+                    level--;
+                codec.pos++;
+                continue;
+            }
+            std::string_view token;
+            bool escaped;
+            if (!codec.scanString(token, escaped))
+                return std::nullopt;
+            // Only keys are followed by a colon
+            codec.skipWhitespace();
+            if (codec.pos >= json.size() || json[codec.pos] != ':')
+                continue;
+            codec.pos++;
+            if (level != depth || escaped || token != key)
+                continue;
+            codec.skipWhitespace();
+            if (codec.pos >= json.size() || json[codec.pos] != '"')
+                continue;
+            std::string_view value;
+            if (!codec.scanString(value, escaped) || escaped)
+                return std::nullopt;
+            return value;
+        }
+        return std::nullopt;
+    }
+
+    // Encode s as a quoted JSON string
+    static std::string quote(std::string_view s)
+    {
+        static const char hex[] = "0123456789abcdef";
+        std::string out;
+        out.reserve(s.size() + 2);
+        out += '"';
+        for (char c : s)
+        {
+            switch (c)
+            {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if ((unsigned char) c < 0x20)
+                {
+                    out += "\\u00";
+                    out += hex[(c >> 4) & 0xF];
+                    out += hex[c & 0xF];
+                }
+                else
+                    out += c;
+            }
+        }
+        out += '"';
+        return out;
+    }
+
+    // Parse a complete JSON document into out. Returns false on malformed input, out is left in an unspecified state then.
+    static bool parse(std::string_view json, boost::property_tree::ptree &out)
+    {
+        JsonCodec codec(json);
+        out.clear();
+        if (!codec.parseValue(out, 0))
+            return false;
+        codec.skipWhitespace();
+        return codec.pos == json.size();
+    }
+};
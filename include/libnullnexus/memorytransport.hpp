@@ -0,0 +1,43 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "transport.hpp"
+
+#include <boost/beast/_experimental/test/stream.hpp>
+
+#include <functional>
+
+namespace beast = boost::beast; // from <boost/beast.hpp>
+
+// In-memory transport, useful for loopback testing without any sockets.
+// The peer callback gets the client side stream on every connection attempt and is expected to
+// connect it (beast::test::stream::connect) to a stream it serves on its own thread/io_context.
+// Returning an error code fails the connection attempt.
+struct MemoryTransport
+{
+    using socket_type = beast::test::stream;
+
+    std::string host;
+    std::function<boost::system::error_code(socket_type &)> peer;
+
+    MemoryTransport(std::function<boost::system::error_code(socket_type &)> peer, std::string host = "localhost") : host(host), peer(peer)
+    {
+    }
+
+    const std::string &handshakeHost() const
+    {
+        return host;
+    }
+
+    template <typename Handler> void asyncConnect(socket_type &socket, Handler handler)
+    {
+        handler(peer(socket));
+    }
+
+    static void cancel(socket_type &)
+    {
+    }
+};
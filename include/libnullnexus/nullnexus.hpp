@@ -2,55 +2,132 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
+#pragma once
+
+#include "authedplayercache.hpp"
+#include "chathistory.hpp"
+#include "handlerexecutor.hpp"
+#include "inboundqueue.hpp"
+#include "json.hpp"
+#include "tf2server.hpp"
+#include "userdirectory.hpp"
 #include "websocketclient.hpp"
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+
 // Reference implementation of a cheat-agnostic nullnexus client
 class NullNexus
 {
 public:
-    // TF2 Server info + steamid, used for authenticating with other nullnexus users
-    struct TF2Server
+    // See tf2server.hpp
+    using TF2Server = ::TF2Server;
+
+    struct UserSettings
     {
-        bool connected;
-        std::string ip;
-        std::string port;
-        std::string steamid;
-        int server_spawn_count;
+        std::optional<std::string> username;
+        std::optional<int> colour;
+        std::optional<TF2Server> tf2server;
+        // Chat locations to receive. Until set, all of them; an empty list means none.
+        // Locations can't contain ',' (the handshake header is a comma separated list), such entries are ignored.
+        std::optional<std::vector<std::string>> subscriptions;
 
-        bool operator==(TF2Server &other)
+        bool isSubscribed(std::string_view location) const
         {
-            return connected == other.connected && ip == other.ip && port == other.port && steamid == other.steamid && server_spawn_count == other.server_spawn_count;
+            return !subscriptions || std::find(subscriptions->begin(), subscriptions->end(), location) != subscriptions->end();
         }
-        TF2Server(bool connected = false, std::string ip = "", std::string port = "", std::string steamid = "", int server_spawn_count = -1) : connected(connected), ip(ip), port(port), steamid(steamid), server_spawn_count(server_spawn_count)
+        static bool isValidLocation(std::string_view location)
         {
+            return !location.empty() && location.find(',') == std::string_view::npos;
         }
     };
 
-    struct UserSettings
+    // Chat message as passed to setHandlerChatMessage, the views are only valid during the handler call
+    struct ChatMessage
     {
-        std::optional<std::string> username;
-        std::optional<int> colour;
-        std::optional<TF2Server> tf2server;
+        UserDirectory::UserId user_id;
+        std::string_view user;
+        std::string_view msg;
+        std::string_view loc;
+        int colour;
     };
 
 private:
-    std::unique_ptr<WebSocketClient> ws;
+    /*
+     * Thread safety: ws, settings and the callbacks are immutable objects published through std::atomic_load/std::atomic_store.
+     * Readers (sending, message handling) just grab the current snapshot, writers (changeData, connect, ...) build a new object and swap it in.
+     * Writers are serialized by write_mutex, the read/send paths never wait on it. They are not lock-free though: the shared_ptr atomics
+     * are implemented with a pool of mutexes (libstdc++), held only while the pointer is copied.
+     */
+    std::shared_ptr<WebSocketClient> ws;
+    std::shared_ptr<const UserSettings> settings = std::make_shared<const UserSettings>();
     // Are settings set up yet?
-    bool settings_set = false;
-    UserSettings settings;
+    std::atomic<bool> settings_set{ false };
+    // Was the current username generated for "anon"? Asking for "anon" again keeps it then.
+    std::atomic<bool> anonymous_username{ false };
+    ClientOptions client_options;
+    // Runtime shared with other instances, null to let every connection bring its own
+    std::shared_ptr<Runtime> runtime;
+    std::mutex write_mutex;
+    // Anonymous usernames and random colours, needs write_mutex to be held
+    std::mt19937 rng{ std::random_device()() };
 
     // Callbacks
-    std::optional<std::function<bool(boost::property_tree::ptree tree)>> callback_custom;
-    std::optional<std::function<void(std::string username, std::string message, int colour)>> callback_chat;
-    std::optional<std::function<void(std::vector<std::string> steamids)>> callback_authedplayers;
+    std::shared_ptr<const std::function<bool(std::string_view message)>> callback_raw;
+    std::shared_ptr<const std::function<bool(boost::property_tree::ptree tree)>> callback_custom;
+    std::shared_ptr<const std::function<void(std::string username, std::string message, int colour)>> callback_chat;
+    std::shared_ptr<const std::function<void(const ChatMessage &message)>> callback_chatmessage;
+    std::shared_ptr<const std::function<void(std::vector<std::string> steamids)>> callback_authedplayers;
+    // Where messages are handled, null to handle them on the IO thread
+    std::shared_ptr<HandlerExecutor> handler_executor;
+    // Messages waiting for the executor, one queue (and executor lane) per kind of message
+    enum InboundLane
+    {
+        LANE_CHAT,
+        LANE_AUTHEDPLAYERS,
+        LANE_DATAUPDATE,
+        LANE_OTHER,
+        LANE_COUNT
+    };
+    static constexpr std::array<const char *, LANE_COUNT> lane_names = { "chat", "authedplayers", "dataupdate", "other" };
+    std::array<InboundQueue, LANE_COUNT> inbound;
 
-    bool sendAuthenticatedMessage(bool reliable, std::string type, boost::property_tree::ptree &child)
+    // Chat history, null if disabled
+    std::shared_ptr<ChatHistory> chat_history;
+    // Every user we have heard of
+    UserDirectory users;
+    // Last authed players of recently visited game servers
+    AuthedPlayerCache authed_cache;
+    // Game server changes made, and how many of them the server has read. The lists received in between may still be for the previous server.
+    std::atomic<std::uint64_t> server_changes{ 0 };
+    std::atomic<std::uint64_t> server_changes_read{ 0 };
+    // Newest list received while a change was not read yet, with the server and the number of changes at that time
+    struct UnconfirmedAuthed
+    {
+        TF2Server server;
+        std::uint64_t changes;
+        std::vector<std::string> steamids;
+    };
+    std::optional<UnconfirmedAuthed> unconfirmed_authed;
+    std::mutex authed_mutex;
+
+    // Atomically replace a published object
+    template <typename T> static std::shared_ptr<const T> publish(std::shared_ptr<const T> &target, T value)
+    {
+        std::shared_ptr<const T> published = std::make_shared<T>(std::move(value));
+        std::atomic_store(&target, published);
+        return published;
+    }
+
+    static std::string encodeAuthenticatedMessage(const UserSettings &settings, std::string type, boost::property_tree::ptree &child)
     {
-        if (!ws)
-            return false;
         boost::property_tree::ptree pt;
         // Basic data
         pt.put("username", *settings.username);
@@ -61,140 +138,639 @@ private:
 
         std::ostringstream buf;
         write_json(buf, pt, false);
-        return ws->sendMessage(buf.str(), reliable);
+        return buf.str();
+    }
+    // Start of a message as built by encodeAuthenticatedMessage, up to the data
+    static std::string envelopePrefix(const UserSettings &settings, std::string_view type)
+    {
+        return "{\"username\":" + JsonCodec::quote(*settings.username) + ",\"type\":" + JsonCodec::quote(type) + ",\"data\":";
+    }
+    bool sendAuthenticatedMessage(bool reliable, std::string type, boost::property_tree::ptree &child)
+    {
+        auto ws       = std::atomic_load(&this->ws);
+        auto settings = std::atomic_load(&this->settings);
+        if (!ws || !settings->username)
+            return false;
+        return ws->sendMessage(encodeAuthenticatedMessage(*settings, type, child), reliable);
     }
 
     void handleMessage_chat(boost::property_tree::ptree &tree)
     {
-        auto data = tree.get_child("data");
-        if (callback_chat)
-            (*callback_chat)(data.get<std::string>("user"), data.get<std::string>("msg"), data.get<int>("colour"));
+        auto data = tree.get_child_optional("data");
+        if (!data)
+            return;
+        // Reference the strings in the tree directly, no copies on the way to the handlers
+        auto user   = data->get_child_optional("user");
+        auto msg    = data->get_child_optional("msg");
+        auto colour = data->get_optional<int>("colour");
+        if (!user || !msg || !colour)
+            return;
+        // Messages without a location are public
+        auto loc = data->get_child_optional("loc");
+        std::string_view location = loc ? std::string_view(loc->data()) : std::string_view("public");
+        // Catches what the peek in handleMessage could not decide
+        if (!std::atomic_load(&settings)->isSubscribed(location))
+            return;
+        auto user_id = users.intern(user->data());
+        users.setColour(user_id, *colour);
+        if (auto history = std::atomic_load(&chat_history))
+            history->push(user->data(), msg->data(), location, *colour);
+        if (auto callback = std::atomic_load(&callback_chatmessage))
+        {
+            (*callback)(ChatMessage{ user_id, user->data(), msg->data(), location, *colour });
+        }
+        if (auto callback = std::atomic_load(&callback_chat))
+            (*callback)(user->data(), msg->data(), *colour);
+    }
+
+    // Other users settings, if the server relays them
+    void handleMessage_dataupdate(boost::property_tree::ptree &tree)
+    {
+        auto username = tree.get_optional<std::string>("username");
+        auto data     = tree.get_child_optional("data");
+        if (!username || !data)
+            return;
+        auto user_id = users.intern(*username);
+        if (auto colour = data->get_optional<int>("colour"))
+            users.setColour(user_id, *colour);
+        if (auto server = data->get_child_optional("server"))
+        {
+            auto field = [&](const char *key) -> std::optional<std::string> {
+                if (auto value = server->get_optional<std::string>(key))
+                    return *value;
+                return std::nullopt;
+            };
+            if (server->get<bool>("connected", false))
+                users.setServer(user_id, field("steamid"), field("ip"), field("port"));
+            else
+                users.setServer(user_id, field("steamid"), std::nullopt, std::nullopt);
+        }
     }
 
     void handleMessage_authedplayers(boost::property_tree::ptree &tree)
     {
-        if (!callback_authedplayers)
+        auto data = tree.get_child_optional("data");
+        if (!data)
             return;
         std::vector<std::string> steamids;
-        for (auto &item : tree.get_child("data"))
-            steamids.push_back(item.second.get<std::string>("steamid"));
-        (*callback_authedplayers)(steamids);
+        for (auto &item : *data)
+        {
+            auto steamid = item.second.get_optional<std::string>("steamid");
+            if (!steamid)
+                return;
+            steamids.push_back(*steamid);
+        }
+        // Settings first: a server change is counted before it is published, so the new server is never paired with an old count
+        auto server = std::atomic_load(&settings)->tf2server;
+        if (server && server->connected())
+        {
+            std::lock_guard<std::mutex> lock(authed_mutex);
+            auto changes = server_changes.load();
+            if (server_changes_read == changes)
+            {
+                authed_cache.put(server->identity(), steamids);
+                unconfirmed_authed.reset();
+            }
+            else
+                unconfirmed_authed = UnconfirmedAuthed{ *server, changes, steamids };
+        }
+        if (auto callback = std::atomic_load(&callback_authedplayers))
+            (*callback)(steamids);
+    }
+
+    // Count change as read by the server once it is, see WebSocketClient::fence. Lists of a lost connection are not cached, it may not have been read.
+    // The server answers a change with the list of the new server, so the last list received before that is the one to cache.
+    // Lists it sent before reading the change always arrive before its answer.
+    void awaitServerChange(const std::shared_ptr<WebSocketClient> &ws, std::uint64_t change)
+    {
+        auto reached = [this, change](bool read) {
+            // The client went away before the server got to it, a new one fences again
+            if (!read)
+                return;
+            auto mark = [this, change]() {
+                auto server = std::atomic_load(&settings)->tf2server;
+                std::lock_guard<std::mutex> lock(authed_mutex);
+                if (server_changes_read < change)
+                    server_changes_read = change;
+                if (unconfirmed_authed && unconfirmed_authed->changes == change && server_changes == change && server == unconfirmed_authed->server)
+                    authed_cache.put(unconfirmed_authed->server.identity(), unconfirmed_authed->steamids);
+                if (unconfirmed_authed && unconfirmed_authed->changes <= change)
+                    unconfirmed_authed.reset();
+            };
+            // Lists received before are still waiting in the lane, they have to be handled as unconfirmed
+            if (auto executor = std::atomic_load(&handler_executor))
+                executor->post(lane_names[LANE_AUTHEDPLAYERS], mark);
+            else
+                mark();
+        };
+        if (ws)
+            ws->fence(reached);
+    }
+    // A new client has to confirm what the old one couldn't. Needs write_mutex to be held.
+    void awaitUnreadServerChange(const std::shared_ptr<WebSocketClient> &ws)
+    {
+        auto changes = server_changes.load();
+        if (server_changes_read < changes)
+            awaitServerChange(ws, changes);
+    }
+
+    // Hand the cached authed players of a server we just joined to the handler, the server sends the current list later
+    void restoreAuthedPlayers(const TF2Server &server)
+    {
+        auto cached = authed_cache.get(server.identity());
+        if (!cached)
+            return;
+        auto deliver = [this, cached]() {
+            if (auto callback = std::atomic_load(&callback_authedplayers))
+                (*callback)(*cached);
+        };
+        // Keep the order with the lists coming from the server, and the handler on the thread it is always called on
+        if (auto executor = std::atomic_load(&handler_executor))
+            executor->post(lane_names[LANE_AUTHEDPLAYERS], deliver);
+        else if (auto ws = std::atomic_load(&this->ws))
+            ws->post(deliver);
+    }
+
+    // Chat from a location we are not subscribed to, found without a full decode
+    bool isUnsubscribedChat(std::string_view msg, std::optional<std::string_view> type)
+    {
+        if (type != std::optional<std::string_view>("chat"))
+            return false;
+        auto current = std::atomic_load(&settings);
+        if (!current->subscriptions)
+            return false;
+        auto loc = JsonCodec::peekString(msg, "loc", 2);
+        return loc && !current->isSubscribed(*loc);
     }
 
     void handleMessage(std::string msg)
     {
-        try
-        {
-            // Parse message
-            std::istringstream iss(msg);
-            boost::property_tree::ptree pt;
-            boost::property_tree::read_json(iss, pt);
+        // Drop chat from locations we are not subscribed to before paying for a full decode.
+        // Checked again for queued messages, the subscriptions may have changed in the meantime.
+        if (isUnsubscribedChat(msg, JsonCodec::peekString(msg, "type")))
+            return;
 
-            if (callback_custom)
-                // If the custom callback handled this message, we should stop
-                if ((*callback_custom)(pt))
-                    return;
+        // Parse message, malformed messages are dropped
+        boost::property_tree::ptree pt;
+        if (!JsonCodec::parse(msg, pt))
+            return;
 
-            std::string type = pt.get<std::string>("type");
-            if (type == "chat")
-                handleMessage_chat(pt);
-            else if (type == "authedplayers")
-                handleMessage_authedplayers(pt);
+        if (auto callback = std::atomic_load(&callback_custom))
+            // If the custom callback handled this message, we should stop
+            if ((*callback)(pt))
+                return;
+
+        auto type = pt.get_optional<std::string>("type");
+        if (!type)
+            return;
+        if (*type == "chat")
+            handleMessage_chat(pt);
+        else if (*type == "authedplayers")
+            handleMessage_authedplayers(pt);
+        else if (*type == "dataupdate")
+            handleMessage_dataupdate(pt);
+    }
+    // Sees messages before anything else, on the IO thread
+    bool onRawMessage(std::string_view msg)
+    {
+        auto callback = std::atomic_load(&callback_raw);
+        return callback && (*callback)(msg);
+    }
+    // Entry point for messages from the websocket client
+    void onMessage(std::string msg)
+    {
+        auto executor = std::atomic_load(&handler_executor);
+        if (!executor)
+        {
+            handleMessage(std::move(msg));
+            return;
         }
-        catch (...)
+        // One lane per known message type keeps each type in order, everything else shares a lane.
+        // State is conflated: only the newest player list, and the newest update of each user, is worth handling.
+        InboundLane lane = LANE_OTHER;
+        std::string key;
+        auto type = JsonCodec::peekString(msg, "type");
+        // Filtered chat must not take room in the lane from chat we want
+        if (isUnsubscribedChat(msg, type))
+            return;
+        if (type == std::optional<std::string_view>("chat"))
+            lane = LANE_CHAT;
+        else if (type == std::optional<std::string_view>("authedplayers"))
         {
+            lane = LANE_AUTHEDPLAYERS;
+            key  = "authedplayers";
         }
+        else if (type == std::optional<std::string_view>("dataupdate"))
+        {
+            lane = LANE_DATAUPDATE;
+            // Updates without a (plain) username are not conflated
+            if (auto username = JsonCodec::peekString(msg, "username"))
+                key = *username;
+        }
+        if (inbound[lane].push(std::move(msg), std::move(key)))
+            executor->post(lane_names[lane], std::bind(&NullNexus::drainInbound, this, lane));
+    }
+    // Runs on the executor lane, handles what queued up
+    void drainInbound(InboundLane lane)
+    {
+        std::string msg;
+        while (inbound[lane].pop(msg))
+            handleMessage(std::move(msg));
     }
-    void setCustomHeaders()
+    static std::vector<std::pair<std::string, std::string>> makeCustomHeaders(const UserSettings &settings)
     {
         std::vector<std::pair<std::string, std::string>> headers = { { "nullnexus_colour", std::to_string(*settings.colour) } };
-        if (settings.tf2server && settings.tf2server->connected)
+        if (settings.tf2server && settings.tf2server->connected())
         {
-            headers.push_back({ "nullnexus_server_ip", settings.tf2server->ip });
-            headers.push_back({ "nullnexus_server_port", settings.tf2server->port });
-            headers.push_back({ "nullnexus_server_steamid", settings.tf2server->steamid });
-            headers.push_back({ "nullnexus_server_server_spawn_count", std::to_string(settings.tf2server->server_spawn_count) });
+            headers.push_back({ "nullnexus_server_ip", settings.tf2server->ipString() });
+            headers.push_back({ "nullnexus_server_port", settings.tf2server->portString() });
+            headers.push_back({ "nullnexus_server_steamid", settings.tf2server->steamidString() });
+            headers.push_back({ "nullnexus_server_server_spawn_count", std::to_string(settings.tf2server->serverSpawnCount()) });
         }
-        if (ws)
-            ws->setCustomHeaders(headers);
+        // Sent even when empty, no header means no filter
+        if (settings.subscriptions)
+        {
+            std::string list;
+            for (auto &location : *settings.subscriptions)
+                list += (list.empty() ? "" : ",") + location;
+            headers.push_back({ "nullnexus_subscriptions", list });
+        }
+        return headers;
     }
 
-public:
-    // Change some setting
-    void changeData(UserSettings newsettings = UserSettings())
+    // All settings the server keeps for us except the username, in the form of dataupdate data
+    static boost::property_tree::ptree settingsTree(const UserSettings &settings)
+    {
+        boost::property_tree::ptree pt;
+        if (settings.colour)
+            pt.put("colour", *settings.colour);
+        if (settings.tf2server)
+        {
+            boost::property_tree::ptree pt_server;
+            pt_server.put("connected", settings.tf2server->connected());
+            pt_server.put("ip", settings.tf2server->ipString());
+            pt_server.put("port", settings.tf2server->portString());
+            pt_server.put("steamid", settings.tf2server->steamidString());
+            pt_server.put("server_spawn_count", settings.tf2server->serverSpawnCount());
+            pt.put_child("server", pt_server);
+        }
+        if (settings.subscriptions)
+        {
+            boost::property_tree::ptree pt_subscriptions;
+            for (auto &location : *settings.subscriptions)
+                pt_subscriptions.push_back({ "", boost::property_tree::ptree(location) });
+            pt.put_child("subscriptions", pt_subscriptions);
+        }
+        return pt;
+    }
+    // Settings carried over in a session handoff
+    static std::string encodeSettings(const UserSettings &settings)
     {
+        auto pt = settingsTree(settings);
+        if (settings.username)
+            pt.put("username", *settings.username);
+        std::ostringstream buf;
+        write_json(buf, pt, false);
+        return buf.str();
+    }
+    static std::optional<UserSettings> decodeSettings(std::string_view data)
+    {
+        boost::property_tree::ptree pt;
+        if (!JsonCodec::parse(data, pt))
+            return std::nullopt;
+        UserSettings decoded;
+        if (auto username = pt.get_optional<std::string>("username"))
+            decoded.username = *username;
+        if (auto colour = pt.get_optional<int>("colour"))
+            decoded.colour = *colour;
+        if (auto server = pt.get_child_optional("server"))
+            decoded.tf2server = TF2Server(server->get<bool>("connected", false), server->get<std::string>("ip", ""), server->get<std::string>("port", ""), server->get<std::string>("steamid", ""), server->get<int>("server_spawn_count", -1));
+        if (auto subscriptions = pt.get_child_optional("subscriptions"))
+        {
+            decoded.subscriptions.emplace();
+            for (auto &item : *subscriptions)
+                decoded.subscriptions->push_back(item.second.data());
+        }
+        return decoded;
+    }
+
+    std::vector<std::pair<std::string, std::string>> currentCustomHeaders()
+    {
+        return makeCustomHeaders(*std::atomic_load(&settings));
+    }
+    // A standby connects with the same headers, but is only counted by the server once it sent something.
+    // This dataupdate goes first when it takes over, with all settings since its headers may be outdated by then.
+    std::string standbyActivation()
+    {
+        auto current = std::atomic_load(&settings);
+        auto pt      = settingsTree(*current);
+        return encodeAuthenticatedMessage(*current, "dataupdate", pt);
+    }
+    void setupClient(WebSocketClient &client)
+    {
+        client.setCustomHeaderSource(std::bind(&NullNexus::currentCustomHeaders, this));
+        client.setRawHandler(std::bind(&NullNexus::onRawMessage, this, std::placeholders::_1));
+        client.setStandbyActivation({ { "nullnexus_standby", "1" } }, std::bind(&NullNexus::standbyActivation, this));
+    }
+
+    // Needs write_mutex to be held
+    void changeDataLocked(UserSettings newsettings)
+    {
+        auto current = std::atomic_load(&settings);
+        // Nothing to publish or send, changeData checked before taking the lock but may have raced another writer
+        if (settings_set && isUnchanged(*current, newsettings, anonymous_username))
+            return;
         settings_set = true;
+        UserSettings updated(*current);
         {
-            if ((!settings.username && !newsettings.username) || (newsettings.username && *newsettings.username == "anon"))
-                settings.username = "Anon-" + std::to_string(rand() % 9000 + 1000);
-            else if (!settings.username || (newsettings.username && *newsettings.username != *settings.username))
-                settings.username = *newsettings.username;
+            if ((!updated.username && !newsettings.username) || (newsettings.username && *newsettings.username == "anon" && !anonymous_username))
+            {
+                updated.username   = "Anon-" + std::to_string(std::uniform_int_distribution<int>(1000, 9999)(rng));
+                anonymous_username = true;
+            }
+            else if (newsettings.username && *newsettings.username != "anon" && newsettings.username != updated.username)
+            {
+                updated.username   = *newsettings.username;
+                anonymous_username = false;
+            }
         }
         // RNG colour generator
-        if (!newsettings.colour && !settings.colour)
+        if (!newsettings.colour && !updated.colour)
         {
-            int r              = (rand() % 255 + 255) / 2;
-            int g              = (rand() % 255 + 255) / 2;
-            int b              = (rand() % 255 + 255) / 2;
+            std::uniform_int_distribution<int> channel(0, 254);
+            int r              = (channel(rng) + 255) / 2;
+            int g              = (channel(rng) + 255) / 2;
+            int b              = (channel(rng) + 255) / 2;
             newsettings.colour = (r << 16) + (g << 8) + b;
         }
         boost::property_tree::ptree pt;
         // Set colour
-        if (newsettings.colour && *newsettings.colour != *settings.colour)
+        if (newsettings.colour && (!updated.colour || *newsettings.colour != *updated.colour))
         {
-            settings.colour = *newsettings.colour;
-            pt.put("colour", *settings.colour);
+            updated.colour = *newsettings.colour;
+            pt.put("colour", *updated.colour);
         }
         // Send info about current server to nullnexus instance
-        if (newsettings.tf2server && (!settings.tf2server || !(*newsettings.tf2server == *settings.tf2server)))
+        std::optional<std::uint64_t> server_change;
+        if (newsettings.tf2server && (!updated.tf2server || *newsettings.tf2server != *updated.tf2server))
         {
+            server_change = ++server_changes;
             boost::property_tree::ptree pt_server;
-            pt_server.put("connected", newsettings.tf2server->connected);
-            if (newsettings.tf2server->connected)
+            pt_server.put("connected", newsettings.tf2server->connected());
+            if (newsettings.tf2server->connected())
             {
-                pt_server.put("ip", newsettings.tf2server->ip);
-                pt_server.put("port", newsettings.tf2server->port);
-                pt_server.put("steamid", newsettings.tf2server->steamid);
-                pt_server.put("server_spawn_count", std::to_string(settings.tf2server->server_spawn_count));
+                pt_server.put("ip", newsettings.tf2server->ipString());
+                pt_server.put("port", newsettings.tf2server->portString());
+                pt_server.put("steamid", newsettings.tf2server->steamidString());
+                pt_server.put("server_spawn_count", std::to_string(newsettings.tf2server->serverSpawnCount()));
             }
-            settings.tf2server = *newsettings.tf2server;
+            updated.tf2server = *newsettings.tf2server;
             pt.put_child("server", pt_server);
         }
-        if (pt.size())
+        // Let the server filter chat for us
+        if (newsettings.subscriptions)
         {
-            sendAuthenticatedMessage(false, "dataupdate", pt);
-            // In case of reconnect
-            setCustomHeaders();
+            auto &locations = *newsettings.subscriptions;
+            locations.erase(std::remove_if(locations.begin(), locations.end(), [](const std::string &location) { return !UserSettings::isValidLocation(location); }), locations.end());
         }
+        if (newsettings.subscriptions && newsettings.subscriptions != updated.subscriptions)
+        {
+            boost::property_tree::ptree pt_subscriptions;
+            for (auto &location : *newsettings.subscriptions)
+                pt_subscriptions.push_back({ "", boost::property_tree::ptree(location) });
+            updated.subscriptions = *newsettings.subscriptions;
+            pt.put_child("subscriptions", pt_subscriptions);
+        }
+        // Publish before sending, so the dataupdate already uses the new username.
+        // The connection headers are built from the published settings before every handshake, nothing to update for a reconnect.
+        auto published = publish(settings, updated);
+        auto ws        = std::atomic_load(&this->ws);
+        // Queued to the IO thread, not waited for
+        if (pt.size() && ws)
+            ws->postMessage(encodeAuthenticatedMessage(*published, "dataupdate", pt));
+        if (server_change)
+            awaitServerChange(ws, *server_change);
+    }
+    // Would newsettings leave current as it is? anonymous tells if the current username was generated for "anon".
+    // Compares the way changeDataLocked applies newsettings, without allocating.
+    static bool isUnchanged(const UserSettings &current, const UserSettings &newsettings, bool anonymous)
+    {
+        if (newsettings.username && (*newsettings.username == "anon" ? !anonymous : newsettings.username != current.username))
+            return false;
+        if (newsettings.subscriptions && !sameLocations(current.subscriptions, *newsettings.subscriptions))
+            return false;
+        return (!newsettings.colour || newsettings.colour == current.colour) && (!newsettings.tf2server || newsettings.tf2server == current.tf2server);
+    }
+    // Is locations without its invalid entries the (already filtered) current list?
+    static bool sameLocations(const std::optional<std::vector<std::string>> &current, const std::vector<std::string> &locations)
+    {
+        if (!current)
+            return false;
+        auto it = current->begin();
+        for (auto &location : locations)
+        {
+            if (!UserSettings::isValidLocation(location))
+                continue;
+            if (it == current->end() || *it != location)
+                return false;
+            ++it;
+        }
+        return it == current->end();
+    }
+
+public:
+    // Change some setting
+    // Joining a game server with cached authed players hands them to the authed players handler right away,
+    // on the handler executor if there is one and on the IO thread otherwise (not at all before connecting).
+    // Never waits for the IO thread, and returns right away if nothing changed, so it can be called every tick.
+    void changeData(UserSettings newsettings = UserSettings())
+    {
+        if (settings_set && isUnchanged(*std::atomic_load(&settings), newsettings, anonymous_username))
+            return;
+        std::optional<TF2Server> joined;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            auto before = std::atomic_load(&settings)->tf2server;
+            changeDataLocked(newsettings);
+            auto after = std::atomic_load(&settings)->tf2server;
+            if (after && after->connected() && before != after)
+                joined = after;
+        }
+        if (joined)
+            restoreAuthedPlayers(*joined);
+    }
+    // Receive chat from location. Until the first subscription chat from all locations is received,
+    // unsubscribing from the last one receives none. Returns false if location can't be subscribed to (empty or containing ',').
+    bool subscribe(std::string location)
+    {
+        if (!UserSettings::isValidLocation(location))
+            return false;
+        std::lock_guard<std::mutex> lock(write_mutex);
+        auto subscriptions = std::atomic_load(&settings)->subscriptions.value_or(std::vector<std::string>());
+        if (std::find(subscriptions.begin(), subscriptions.end(), location) != subscriptions.end())
+            return true;
+        subscriptions.push_back(location);
+        UserSettings newsettings;
+        newsettings.subscriptions = subscriptions;
+        changeDataLocked(newsettings);
+        return true;
+    }
+    // Returns false if not subscribed to location
+    bool unsubscribe(std::string location)
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        auto subscriptions = std::atomic_load(&settings)->subscriptions.value_or(std::vector<std::string>());
+        auto it            = std::find(subscriptions.begin(), subscriptions.end(), location);
+        if (it == subscriptions.end())
+            return false;
+        subscriptions.erase(it);
+        UserSettings newsettings;
+        newsettings.subscriptions = subscriptions;
+        changeDataLocked(newsettings);
+        return true;
     }
     void disconnect()
     {
-        if (ws)
+        if (auto ws = std::atomic_load(&this->ws))
             ws->stop();
     }
     void reconnect(bool async = false)
     {
-        if (ws)
-            ws->stop();
+        auto ws = std::atomic_load(&this->ws);
+        if (!ws)
+            return;
+        ws->stop();
         ws->start(async);
     }
+    // Affinity, priority and name of the IO thread, takes effect on the next connect
+    void setThreadOptions(ThreadOptions options)
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        client_options.thread = options;
+    }
+    // All websocket client settings (IO thread, read buffer, ...), takes effect on the next connect
+    void setClientOptions(ClientOptions options)
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        client_options = options;
+    }
+    // Handle incoming messages (parsing and all callbacks) on executor instead of the IO thread, null to go back to inline handling.
+    // Messages of the same type are handled in order, different types may be handled in parallel if the executor has more than one thread.
+    void setHandlerExecutor(std::shared_ptr<HandlerExecutor> executor)
+    {
+        std::shared_ptr<HandlerExecutor> previous;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            previous = std::atomic_exchange(&handler_executor, executor);
+        }
+        // Nothing may still be running against the old one when the caller drops it. Waiting without the lock, handlers may change data.
+        if (previous)
+            previous->wait();
+    }
+    // Last authed players known for a game server, if it was visited recently
+    std::optional<std::vector<std::string>> getCachedAuthedPlayers(const TF2Server &server)
+    {
+        if (auto cached = authed_cache.get(server.identity()))
+            return *cached;
+        return std::nullopt;
+    }
+    // Limits for messages waiting for the handler executor, per kind of message.
+    // Player lists and user updates are conflated and only take one slot (per user), chat and custom messages queue up.
+    void setInboundOptions(InboundOptions options)
+    {
+        for (auto &queue : inbound)
+            queue.setOptions(options);
+    }
+    // Messages dropped so far because the handler executor could not keep up
+    std::uint64_t getInboundDropped()
+    {
+        std::uint64_t dropped = 0;
+        for (auto &queue : inbound)
+            dropped += queue.droppedCount();
+        return dropped;
+    }
+    // Run connections on a runtime shared with other NullNexus instances (see runtime.hpp), takes effect on the next connect.
+    // Thread options of the client options are ignored then, the runtime's threads are used.
+    void setRuntime(std::shared_ptr<Runtime> shared_runtime)
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        runtime = shared_runtime;
+    }
+    // Connect using any transport supported by BasicWebSocketClient (see transport.hpp)
+    template <typename Transport> void connectTransport(Transport transport, std::string endpoint = "/api/v1/client", bool async = false)
+    {
+        std::shared_ptr<WebSocketClient> client, previous;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            if (!settings_set)
+                changeDataLocked(UserSettings());
+            client = std::make_shared<BasicWebSocketClient<Transport>>(transport, endpoint, std::bind(&NullNexus::onMessage, this, std::placeholders::_1), client_options, runtime);
+            setupClient(*client);
+            awaitUnreadServerChange(client);
+            previous = std::atomic_exchange(&ws, client);
+        }
+        // Destroying the old client waits for its IO thread, whose handlers may need write_mutex
+        previous.reset();
+        client->start(async);
+    }
+    // Take the live connection out, so a new instance (e.g. after reloading the module) can continue it with adoptTransport.
+    // Needs ClientOptions::handoff. The settings go along, this instance is disconnected afterwards. Null if not connected.
+    std::optional<SessionHandoff> exportSession()
+    {
+        std::shared_ptr<WebSocketClient> ws;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            ws = std::atomic_load(&this->ws);
+        }
+        if (!ws)
+            return std::nullopt;
+        // Waits for the IO thread, whose handlers may need write_mutex
+        auto handoff = ws->detach();
+        if (handoff)
+            handoff->user_data = encodeSettings(*std::atomic_load(&settings));
+        return handoff;
+    }
+    // Continue a session exported by exportSession instead of connecting, nothing is sent to the server.
+    // transport and endpoint are used for reconnects should the connection fail later. Returns false if the session could not be adopted,
+    // handoff is left untouched then and its descriptor still belongs to the caller.
+    template <typename Transport> bool adoptTransport(Transport transport, SessionHandoff &handoff, std::string endpoint = "/api/v1/client")
+    {
+        // The server already knows the settings of the session, they only become ours once we have the session
+        auto restored = decodeSettings(handoff.user_data);
+        std::shared_ptr<BasicWebSocketClient<Transport>> client;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            client = std::make_shared<BasicWebSocketClient<Transport>>(transport, endpoint, std::bind(&NullNexus::onMessage, this, std::placeholders::_1), client_options, runtime);
+        }
+        setupClient(*client);
+        // Waits for the IO thread like destroying a client does, neither may happen with write_mutex held
+        if (!client->adopt(handoff))
+            return false;
+        std::shared_ptr<WebSocketClient> previous;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            if (restored)
+            {
+                publish(settings, *restored);
+                settings_set       = true;
+                anonymous_username = false;
+            }
+            if (!settings_set)
+                changeDataLocked(UserSettings());
+            awaitUnreadServerChange(client);
+            previous = std::atomic_exchange(&ws, std::shared_ptr<WebSocketClient>(client));
+        }
+        return true;
+    }
     // Connect to a specific server
     void connect(std::string host = "localhost", std::string port = "3000", std::string endpoint = "/api/v1/client", bool async = false)
     {
-        if (!settings_set)
-            changeData();
-        ws = std::make_unique<WebSocketClient>(host, port, endpoint, std::bind(&NullNexus::handleMessage, this, std::placeholders::_1));
-        setCustomHeaders();
-        ws->start(async);
+        connectTransport(TcpTransport(host, port), endpoint, async);
     }
 #ifdef __linux__
     void connectunix(std::string socket = "/tmp/nullnexus.sock", std::string endpoint = "/api/v1/client", bool async = false)
     {
-        if (!settings_set)
-            changeData();
-        ws = std::make_unique<WebSocketClient>(socket, endpoint, std::bind(&NullNexus::handleMessage, this, std::placeholders::_1));
-        setCustomHeaders();
-        ws->start(async);
+        connectTransport(UnixTransport(socket), endpoint, async);
     }
 #endif
     // Send a chat message
@@ -210,20 +786,138 @@ public:
         pt.put("loc", location);
         return sendAuthenticatedMessage(false, "chat", pt);
     }
+    // Send a custom message whose data is already serialized JSON, it is spliced into the envelope as is.
+    // sendIfOffline queues the message until connected instead of failing, see WebSocketClient::sendMessage.
+    bool sendCustom(std::string_view type, std::string_view json_data, bool sendIfOffline = false)
+    {
+        auto ws       = std::atomic_load(&this->ws);
+        auto settings = std::atomic_load(&this->settings);
+        if (!ws || !settings->username)
+            return false;
+        std::string msg = envelopePrefix(*settings, type);
+        msg.reserve(msg.size() + json_data.size() + 1);
+        msg.append(json_data);
+        msg.push_back('}');
+        return ws->sendMessage(std::move(msg), sendIfOffline);
+    }
+    // Same as sendCustom, taking over the caller's buffer for large payloads. The envelope is added around the data in place
+    // and the buffer itself goes to the IO thread. The data moves within the buffer once to make room for the envelope,
+    // and is copied to a new allocation if the buffer's capacity can't hold the envelope too (reserve it up front to avoid that).
+    bool sendCustomBuffer(std::string_view type, std::string &&json_data, bool sendIfOffline = false)
+    {
+        auto ws       = std::atomic_load(&this->ws);
+        auto settings = std::atomic_load(&this->settings);
+        if (!ws || !settings->username)
+            return false;
+        auto prefix = envelopePrefix(*settings, type);
+        // At most one reallocation, instead of one for the prefix and possibly another for the closing brace
+        json_data.reserve(json_data.size() + prefix.size() + 1);
+        json_data.insert(0, prefix);
+        json_data.push_back('}');
+        return ws->sendMessage(std::move(json_data), sendIfOffline);
+    }
+    // Send many custom messages (type and serialized data, see sendCustom) with a single handoff to the IO thread
+    bool sendCustomBatch(const std::vector<std::pair<std::string, std::string>> &batch, bool sendIfOffline = false)
+    {
+        auto ws       = std::atomic_load(&this->ws);
+        auto settings = std::atomic_load(&this->settings);
+        if (!ws || !settings->username)
+            return false;
+        std::vector<std::string> messages;
+        messages.reserve(batch.size());
+        for (auto &entry : batch)
+            messages.push_back(envelopePrefix(*settings, entry.first) + entry.second + "}");
+        return ws->sendBatch(std::move(messages), sendIfOffline);
+    }
+    // Send a custom message whose data is too large to build in memory at once.
+    // producer returns the serialized JSON of the data field piece by piece (see WebSocketClient::sendStream), the envelope is added around it.
+    bool sendCustomStream(std::string type, std::function<bool(std::string &chunk)> producer, std::function<void(bool)> done = nullptr)
+    {
+        auto ws       = std::atomic_load(&this->ws);
+        auto settings = std::atomic_load(&this->settings);
+        if (!ws || !settings->username)
+            return false;
+        std::string prefix = envelopePrefix(*settings, type);
+        enum class Stage
+        {
+            prefix,
+            data,
+            suffix
+        };
+        ws->sendStream(
+            [prefix, producer, stage = Stage::prefix](std::string &chunk) mutable {
+                switch (stage)
+                {
+                case Stage::prefix:
+                    chunk = prefix;
+                    stage = Stage::data;
+                    return true;
+                case Stage::data:
+                    if (!producer(chunk))
+                        stage = Stage::suffix;
+                    return true;
+                default:
+                    chunk = "}";
+                    return false;
+                }
+            },
+            done);
+        return true;
+    }
+    // Add a handler that sees every message as it arrived, before any parsing (including setHandlerCustom).
+    // It runs on the IO thread, even with a handler executor, and the view is only valid during the call.
+    // Return true if your handler handled the message, false if you want the class to handle it.
+    void setHandlerRaw(std::function<bool(std::string_view message)> handler)
+    {
+        publish(callback_raw, handler);
+    }
     // Add a handler that overrides all other handlers implemented by this class.
     // Return true if your handler handled the message, false if you want the class to handle it.
     void setHandlerCustom(std::function<bool(boost::property_tree::ptree tree)> handler)
     {
-        callback_custom = handler;
+        publish(callback_custom, handler);
     }
     // Handle chat messages
     void setHandlerChat(std::function<void(std::string username, std::string message, int colour)> handler)
     {
-        callback_chat = handler;
+        publish(callback_chat, handler);
+    }
+    // Handle chat messages, with the sender interned in the user directory
+    void setHandlerChatMessage(std::function<void(const ChatMessage &message)> handler)
+    {
+        publish(callback_chatmessage, handler);
+    }
+    // Usernames and metadata of everyone seen in chat or dataupdates
+    const UserDirectory &getUserDirectory()
+    {
+        return users;
+    }
+    // Keep the last capacity chat messages in memory, replaces any previous history
+    void enableChatHistory(std::size_t capacity)
+    {
+        std::atomic_store(&chat_history, std::make_shared<ChatHistory>(capacity));
+    }
+    void disableChatHistory()
+    {
+        std::atomic_store(&chat_history, std::shared_ptr<ChatHistory>());
+    }
+    // Null if chat history is disabled
+    std::shared_ptr<const ChatHistory> getChatHistory()
+    {
+        return std::atomic_load(&chat_history);
     }
     // Handle authedplayers messages
     void setHandlerAuthedplayers(std::function<void(std::vector<std::string>)> handler)
     {
-        callback_authedplayers = handler;
+        publish(callback_authedplayers, handler);
+    }
+
+    ~NullNexus()
+    {
+        // Stop the worker before the callbacks and settings it uses go away
+        std::atomic_store(&ws, std::shared_ptr<WebSocketClient>());
+        // Messages already handed to the executor refer to us as well
+        if (auto executor = std::atomic_load(&handler_executor))
+            executor->wait();
     }
 };
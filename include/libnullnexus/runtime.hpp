@@ -0,0 +1,71 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "clock.hpp"
+#include "threadoptions.hpp"
+#include "timerwheel.hpp"
+
+#include <boost/asio/executor_work_guard.hpp>
+
+#include <thread>
+#include <vector>
+
+/*
+ * IO threads and timers shared by any number of clients.
+ *
+ * Every client used to bring its own io_context, worker thread and asio timers. Clients created with a shared runtime
+ * run on its threads instead, each one serialized by its own strand, and keep their timers in the runtime's TimerWheel.
+ * A client without an explicit runtime creates a private one with a single thread.
+ *
+ * Transports whose sockets can't run on a strand (MemoryTransport, SimulatedTransport) need a single threaded runtime.
+ * The runtime must not be destroyed from one of its own threads.
+ */
+template <typename Clock = SteadyClock> class BasicRuntime
+{
+    net::io_context ioc;
+    net::executor_work_guard<net::io_context::executor_type> work;
+    TimerWheel<Clock> wheel;
+    std::vector<std::thread> threads;
+
+    void runIO(const ThreadOptions &thread_options)
+    {
+        thread_options.apply();
+        ioc.run();
+    }
+
+public:
+    // timer_resolution is the tick of the timer wheel, timers due within the same tick share a wakeup
+    BasicRuntime(std::size_t thread_count = 1, ThreadOptions thread_options = ThreadOptions(), typename Clock::duration timer_resolution = std::chrono::milliseconds(10)) : work(ioc.get_executor()), wheel(ioc, timer_resolution)
+    {
+        for (std::size_t i = 0; i < std::max<std::size_t>(thread_count, 1); i++)
+            threads.emplace_back(std::bind(&BasicRuntime::runIO, this, thread_options));
+    }
+    BasicRuntime(const BasicRuntime &) = delete;
+
+    net::io_context &context()
+    {
+        return ioc;
+    }
+
+    TimerWheel<Clock> &timers()
+    {
+        return wheel;
+    }
+
+    std::size_t threadCount() const
+    {
+        return threads.size();
+    }
+
+    ~BasicRuntime()
+    {
+        work.reset();
+        for (auto &thread : threads)
+            thread.join();
+    }
+};
+
+using Runtime = BasicRuntime<>;
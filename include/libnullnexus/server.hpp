@@ -0,0 +1,590 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "json.hpp"
+#include "sharedframe.hpp"
+#include "tf2server.hpp"
+#include "transport.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/websocket.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace beast     = boost::beast;     // from <boost/beast.hpp>
+namespace http      = beast::http;      // from <boost/beast/http.hpp>
+namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
+
+struct ServerOptions
+{
+    // Websocket endpoint clients connect to
+    std::string target = "/api/v1/client";
+    // Messages waiting to be written to one client, a client that falls further behind is disconnected
+    std::size_t max_outgoing = 4096;
+    // Largest message accepted from a client
+    std::size_t max_message_size = 64 * 1024;
+    // Time a new connection gets to send its upgrade request, it is closed afterwards
+    std::chrono::seconds upgrade_timeout = std::chrono::seconds(10);
+    // Linux: let other sockets listen on the same tcp endpoint, the kernel spreads new connections between them
+    bool reuse_port = false;
+};
+
+// What one server tells the others it is sharded with (see ShardedNullNexusServer)
+struct ServerEvent
+{
+    enum Type
+    {
+        // frame goes to local clients subscribed to key (the chat location)
+        Chat,
+        // frame goes to all local clients
+        Relay,
+        // member is on the game server identified by key, with steamid
+        EnterGame,
+        // member left the game server identified by key
+        LeaveGame
+    };
+    Type type = Relay;
+    SharedFrame frame;
+    std::string key;
+    std::uint64_t member = 0;
+    std::string steamid;
+};
+
+/*
+ * Reference nullnexus server, speaking the protocol NullNexus implements:
+ *  - settings arrive as nullnexus_* handshake headers and later as dataupdate messages
+ *  - chat is broadcast to every client subscribed to its location (all of them until subscriptions are set, an empty set means none)
+ *  - dataupdates are relayed to the other clients
+ *  - clients on the same game server (same address, port and spawn count) get the steamids of all of them as authedplayers
+ *  - a connection with the nullnexus_standby header is a client's hot standby, it only counts once it sends something
+ *
+ * Protocol is the socket protocol to listen on, e.g. tcp or local::stream_protocol.
+ * The io_context may be run by any number of threads: every client has its own strand and the shared state is guarded by a mutex.
+ * To use more cores than one mutex allows, several servers can share the load as shards (see ShardedNullNexusServer),
+ * everything one of them broadcasts then goes through its publisher to the others.
+ */
+template <typename Protocol> class BasicNullNexusServer
+{
+    using socket_type = typename Protocol::socket;
+    using strand_type = net::strand<net::io_context::executor_type>;
+
+    struct Session : std::enable_shared_from_this<Session>
+    {
+        BasicNullNexusServer &server;
+        websocket::stream<socket_type> ws;
+        // Bounds the upgrade request, the websocket has its own timeouts after that
+        net::steady_timer upgrade_timer;
+        beast::flat_buffer buf;
+        http::request<http::string_body> req;
+        // Front is being written. Broadcasts share one frame between all recipients.
+        std::deque<SharedFrame> outgoing;
+
+        // Guarded by the server mutex
+        std::string username;
+        int colour = 0;
+        std::optional<TF2Server> game;
+        std::optional<std::vector<std::string>> subscriptions;
+        // Unique across shards, set on join
+        std::uint64_t member = 0;
+        // Hot standby of a client (nullnexus_standby header), not counted as a session until it sends something
+        bool standby = false;
+
+        Session(BasicNullNexusServer &server, socket_type socket) : server(server), ws(std::move(socket)), upgrade_timer(ws.get_executor())
+        {
+        }
+
+        bool isSubscribed(std::string_view location) const
+        {
+            return !subscriptions || std::find(subscriptions->begin(), subscriptions->end(), location) != subscriptions->end();
+        }
+    };
+    using SessionPtr = std::shared_ptr<Session>;
+
+    net::io_context &ioc;
+    ServerOptions options;
+    typename Protocol::acceptor acceptor;
+
+    std::mutex mutex;
+    std::set<SessionPtr> sessions;
+    // Connected standbys, they get nothing until they take over
+    std::set<SessionPtr> standbys;
+    // Accepted, but the upgrade request or the websocket handshake is still running
+    std::set<SessionPtr> upgrading;
+    // Set by stop(), connections that finish their upgrade afterwards are closed instead of joining
+    bool stopped = false;
+    struct Game
+    {
+        // Everyone on the game server, including clients of other shards, by member id
+        std::map<std::uint64_t, std::string> steamids;
+        // Our own clients on it
+        std::set<Session *> local;
+    };
+    // By game server identity (see TF2Server::identity)
+    std::map<std::string, Game> games;
+    std::uint64_t member_base = 0, next_member = 0;
+
+    // Set when sharded
+    std::function<void(const ServerEvent &)> publisher;
+
+    /* Connection setup */
+    void doAccept()
+    {
+        acceptor.async_accept(net::make_strand(ioc), [this](const boost::system::error_code &ec, socket_type socket) {
+            // Closed by stop()
+            if (ec == net::error::basic_errors::operation_aborted)
+                return;
+            if (!ec)
+                onAccept(std::make_shared<Session>(*this, std::move(socket)));
+            doAccept();
+        });
+    }
+
+    void onAccept(SessionPtr session)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopped)
+                return;
+            upgrading.insert(session);
+        }
+        session->ws.read_message_max(options.max_message_size);
+        session->ws.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+        // A client that doesn't send the upgrade request in time is dropped, so idle connections can't pile up
+        session->upgrade_timer.expires_after(options.upgrade_timeout);
+        session->upgrade_timer.async_wait([session](const boost::system::error_code &ec) {
+            // Cancelled, or the request arrived while this was already queued
+            if (ec || session->upgrade_timer.expiry() > net::steady_timer::clock_type::now())
+                return;
+            boost::system::error_code close_ec;
+            session->ws.next_layer().close(close_ec);
+        });
+        // The settings are in the upgrade request, read it ourselves before handing it to the websocket
+        http::async_read(session->ws.next_layer(), session->buf, session->req, [this, session](const boost::system::error_code &ec, std::size_t) {
+            session->upgrade_timer.expires_at(net::steady_timer::time_point::max());
+            if (ec || !websocket::is_upgrade(session->req) || session->req.target() != options.target)
+            {
+                abandon(session);
+                return;
+            }
+            readHeaders(*session);
+            session->ws.async_accept(session->req, [this, session](const boost::system::error_code &ec) {
+                if (ec)
+                {
+                    abandon(session);
+                    return;
+                }
+                if (join(session))
+                    doRead(session);
+            });
+        });
+    }
+
+    static int parseInt(std::string_view text, int fallback)
+    {
+        int value   = fallback;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == std::errc() ? value : fallback;
+    }
+
+    static std::string_view header(const http::request<http::string_body> &req, const char *name)
+    {
+        auto value = req[name];
+        return std::string_view(value.data(), value.size());
+    }
+
+    // Only runs before the session is registered, no lock needed
+    void readHeaders(Session &session)
+    {
+        auto &req       = session.req;
+        session.colour  = parseInt(header(req, "nullnexus_colour"), 0);
+        session.standby = req.count("nullnexus_standby");
+        if (req.count("nullnexus_server_ip"))
+            session.game = TF2Server(true, header(req, "nullnexus_server_ip"), header(req, "nullnexus_server_port"), header(req, "nullnexus_server_steamid"), parseInt(header(req, "nullnexus_server_server_spawn_count"), -1));
+        // Present but empty means subscribed to nothing
+        if (!req.count("nullnexus_subscriptions"))
+            return;
+        session.subscriptions.emplace();
+        std::string_view list = header(req, "nullnexus_subscriptions");
+        while (!list.empty())
+        {
+            auto end = std::min(list.find(','), list.size());
+            if (end)
+                session.subscriptions->emplace_back(list.substr(0, end));
+            list.remove_prefix(std::min(end + 1, list.size()));
+        }
+    }
+    /* ~Connection setup~ */
+
+    /* Shared state, all of these need the mutex to be held */
+    static std::optional<std::string> gameKey(const Session &session)
+    {
+        if (!session.game || !session.game->connected())
+            return std::nullopt;
+        return session.game->identity();
+    }
+
+    // Everyone on the game server gets the steamids of everyone on it. Each shard only builds the list for its own clients.
+    void publishAuthedPlayers(const std::string &key)
+    {
+        auto it = games.find(key);
+        if (it == games.end() || it->second.local.empty())
+            return;
+        std::string msg = "{\"type\":\"authedplayers\",\"data\":[";
+        bool first      = true;
+        for (auto &entry : it->second.steamids)
+        {
+            if (entry.second.empty())
+                continue;
+            msg += std::string(first ? "" : ",") + "{\"steamid\":" + JsonCodec::quote(entry.second) + "}";
+            first = false;
+        }
+        msg += "]}";
+        SharedFrame frame(std::move(msg));
+        for (auto *member : it->second.local)
+            send(member->shared_from_this(), frame);
+    }
+
+    void addMember(const std::string &key, std::uint64_t member, std::string steamid)
+    {
+        games[key].steamids[member] = std::move(steamid);
+        publishAuthedPlayers(key);
+    }
+
+    void removeMember(const std::string &key, std::uint64_t member)
+    {
+        auto it = games.find(key);
+        if (it == games.end())
+            return;
+        it->second.steamids.erase(member);
+        if (it->second.steamids.empty())
+            games.erase(it);
+        else
+            publishAuthedPlayers(key);
+    }
+
+    void publish(ServerEvent event)
+    {
+        if (publisher)
+            publisher(event);
+    }
+
+    void enterGame(Session &session)
+    {
+        if (auto key = gameKey(session))
+        {
+            auto steamid = session.game->steamidString();
+            games[*key].local.insert(&session);
+            addMember(*key, session.member, steamid);
+            publish(ServerEvent{ ServerEvent::EnterGame, SharedFrame(), *key, session.member, steamid });
+        }
+    }
+
+    void leaveGame(Session &session)
+    {
+        auto key = gameKey(session);
+        if (!key)
+            return;
+        auto it = games.find(*key);
+        if (it == games.end())
+            return;
+        it->second.local.erase(&session);
+        removeMember(*key, session.member);
+        publish(ServerEvent{ ServerEvent::LeaveGame, SharedFrame(), *key, session.member, "" });
+    }
+
+    void joinLocked(const SessionPtr &session)
+    {
+        session->member = member_base + next_member++;
+        sessions.insert(session);
+        enterGame(*session);
+    }
+
+    // Returns false if the server was stopped during the upgrade, the session is closed then
+    bool join(SessionPtr session)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        upgrading.erase(session);
+        if (stopped)
+        {
+            session->ws.async_close(websocket::close_code::going_away, [session](const boost::system::error_code &) {});
+            return false;
+        }
+        if (session->standby)
+            standbys.insert(session);
+        else
+            joinLocked(session);
+        return true;
+    }
+
+    // The upgrade failed, the socket closes with the last reference
+    void abandon(const SessionPtr &session)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        upgrading.erase(session);
+    }
+
+    void leave(SessionPtr session)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (sessions.erase(session))
+            leaveGame(*session);
+        standbys.erase(session);
+    }
+    /* ~Shared state~ */
+
+    /* Reading */
+    void doRead(SessionPtr session)
+    {
+        session->ws.async_read(session->buf, [this, session](const boost::system::error_code &ec, std::size_t) {
+            if (ec)
+            {
+                leave(session);
+                return;
+            }
+            auto data = session->buf.cdata();
+            handleMessage(session, std::string_view(static_cast<const char *>(data.data()), data.size()));
+            session->buf.consume(session->buf.size());
+            doRead(session);
+        });
+    }
+
+    void handleMessage(const SessionPtr &session, std::string_view msg)
+    {
+        boost::property_tree::ptree pt;
+        if (!JsonCodec::parse(msg, pt))
+            return;
+        auto type     = pt.get_optional<std::string>("type");
+        auto username = pt.get_optional<std::string>("username");
+        auto data     = pt.get_child_optional("data");
+        if (!type || !username || username->empty() || username->size() > 64 || !data)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        session->username = *username;
+        // The standby took over, its first message (usually a dataupdate with all settings) brings the headers up to date
+        if (session->standby)
+        {
+            session->standby = false;
+            standbys.erase(session);
+            if (*type == "dataupdate" && data->get_child_optional("server"))
+                session->game.reset();
+            joinLocked(session);
+        }
+        if (*type == "chat")
+            handleChat(*session, *data);
+        else if (*type == "dataupdate")
+            handleDataUpdate(*session, *data);
+    }
+
+    // Needs the mutex to be held
+    void handleChat(Session &session, const boost::property_tree::ptree &data)
+    {
+        auto text     = data.get_optional<std::string>("msg");
+        auto location = data.get<std::string>("loc", "public");
+        if (!text || text->empty() || text->size() > 128 || std::any_of(text->begin(), text->end(), [](unsigned char c) { return !std::isprint(c); }))
+            return;
+        std::string msg = "{\"type\":\"chat\",\"data\":{\"user\":" + JsonCodec::quote(session.username) + ",\"msg\":" + JsonCodec::quote(*text) + ",\"colour\":" + JsonCodec::quote(std::to_string(session.colour)) + ",\"loc\":" + JsonCodec::quote(location) + "}}";
+        SharedFrame frame(std::move(msg));
+        for (auto &recipient : sessions)
+            if (recipient->isSubscribed(location))
+                send(recipient, frame);
+        publish(ServerEvent{ ServerEvent::Chat, frame, location, 0, "" });
+    }
+
+    // Needs the mutex to be held
+    void handleDataUpdate(Session &session, const boost::property_tree::ptree &data)
+    {
+        if (auto colour = data.get_optional<int>("colour"))
+            session.colour = *colour;
+        if (auto server = data.get_child_optional("server"))
+        {
+            leaveGame(session);
+            session.game = TF2Server(server->get<bool>("connected", false), server->get<std::string>("ip", ""), server->get<std::string>("port", ""), server->get<std::string>("steamid", ""), server->get<int>("server_spawn_count", -1));
+            enterGame(session);
+        }
+        if (auto subscriptions = data.get_child_optional("subscriptions"))
+        {
+            session.subscriptions.emplace();
+            for (auto &item : *subscriptions)
+                session.subscriptions->push_back(item.second.data());
+        }
+
+        // Tell everyone else
+        std::string msg = "{\"type\":\"dataupdate\",\"username\":" + JsonCodec::quote(session.username) + ",\"data\":{\"colour\":" + JsonCodec::quote(std::to_string(session.colour));
+        if (session.game)
+        {
+            msg += ",\"server\":{\"connected\":" + JsonCodec::quote(session.game->connected() ? "true" : "false");
+            if (session.game->connected())
+                msg += ",\"ip\":" + JsonCodec::quote(session.game->ipString()) + ",\"port\":" + JsonCodec::quote(session.game->portString()) + ",\"steamid\":" + JsonCodec::quote(session.game->steamidString());
+            msg += "}";
+        }
+        msg += "}}";
+        SharedFrame frame(std::move(msg));
+        for (auto &recipient : sessions)
+            if (recipient.get() != &session)
+                send(recipient, frame);
+        publish(ServerEvent{ ServerEvent::Relay, frame, "", 0, "" });
+    }
+    /* ~Reading~ */
+
+    /* Writing */
+    void send(SessionPtr session, SharedFrame frame)
+    {
+        net::post(session->ws.get_executor(), [this, session, frame]() {
+            // Too slow to keep up, let it go instead of buffering without bound
+            if (session->outgoing.size() >= options.max_outgoing)
+            {
+                boost::system::error_code ec;
+                beast::get_lowest_layer(session->ws).close(ec);
+                return;
+            }
+            session->outgoing.push_back(frame);
+            if (session->outgoing.size() == 1)
+                doWrite(session);
+        });
+    }
+
+    // Runs on the session strand
+    void doWrite(SessionPtr session)
+    {
+        session->ws.async_write(session->outgoing.front().buffer(), [this, session](const boost::system::error_code &ec, std::size_t) {
+            // The read fails as well and unregisters the session
+            if (ec)
+            {
+                session->outgoing.clear();
+                return;
+            }
+            session->outgoing.pop_front();
+            if (!session->outgoing.empty())
+                doWrite(session);
+        });
+    }
+    /* ~Writing~ */
+
+public:
+    BasicNullNexusServer(net::io_context &ioc, ServerOptions options = ServerOptions()) : ioc(ioc), options(options), acceptor(net::make_strand(ioc))
+    {
+    }
+    BasicNullNexusServer(const BasicNullNexusServer &) = delete;
+
+    // Start accepting clients on endpoint. Returns false and sets ec if the endpoint can't be listened on.
+    bool listen(typename Protocol::endpoint endpoint, boost::system::error_code &ec)
+    {
+        acceptor.open(endpoint.protocol(), ec);
+        if (ec)
+            return false;
+        if constexpr (std::is_same_v<Protocol, tcp>)
+        {
+            acceptor.set_option(net::socket_base::reuse_address(true), ec);
+#ifdef SO_REUSEPORT
+            if (!ec && options.reuse_port)
+                acceptor.set_option(net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true), ec);
+#endif
+        }
+        if (!ec)
+            acceptor.bind(endpoint, ec);
+        if (!ec)
+            acceptor.listen(net::socket_base::max_listen_connections, ec);
+        if (ec)
+        {
+            boost::system::error_code ignored;
+            acceptor.close(ignored);
+            return false;
+        }
+        net::post(acceptor.get_executor(), [this]() { doAccept(); });
+        return true;
+    }
+
+    typename Protocol::endpoint localEndpoint()
+    {
+        boost::system::error_code ec;
+        return acceptor.local_endpoint(ec);
+    }
+
+    // Stop accepting and disconnect everyone. The io_context runs out of work once the connections are gone.
+    void stop()
+    {
+        net::post(acceptor.get_executor(), [this]() {
+            boost::system::error_code ec;
+            acceptor.close(ec);
+        });
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        for (auto *group : { &sessions, &standbys })
+            for (auto &session : *group)
+                net::post(session->ws.get_executor(), [session]() { session->ws.async_close(websocket::close_code::going_away, [session](const boost::system::error_code &) {}); });
+        // No websocket to close yet, closing the socket fails the pending upgrade read or handshake
+        for (auto &session : upgrading)
+            net::post(session->ws.get_executor(), [session]() {
+                boost::system::error_code ec;
+                session->upgrade_timer.cancel();
+                session->ws.next_layer().close(ec);
+            });
+    }
+
+    // Join a group of shards: events of the others go to deliver(), ours to publisher. member_base keeps member ids unique
+    // across the group. Must be called before listening.
+    void setPublisher(std::function<void(const ServerEvent &)> publisher, std::uint64_t member_base)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->publisher   = std::move(publisher);
+        this->member_base = member_base;
+    }
+
+    // Apply what another shard published
+    void deliver(const ServerEvent &event)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        switch (event.type)
+        {
+        case ServerEvent::Chat:
+            for (auto &recipient : sessions)
+                if (recipient->isSubscribed(event.key))
+                    send(recipient, event.frame);
+            break;
+        case ServerEvent::Relay:
+            for (auto &recipient : sessions)
+                send(recipient, event.frame);
+            break;
+        case ServerEvent::EnterGame:
+            addMember(event.key, event.member, event.steamid);
+            break;
+        case ServerEvent::LeaveGame:
+            removeMember(event.key, event.member);
+            break;
+        }
+    }
+
+    std::size_t clientCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sessions.size();
+    }
+};
+
+using NullNexusServer = BasicNullNexusServer<tcp>;
+#ifdef __linux__
+using UnixNullNexusServer = BasicNullNexusServer<local::stream_protocol>;
+#endif
@@ -0,0 +1,357 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/websocket/detail/hybi13.hpp>
+#include <boost/beast/websocket/teardown.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+
+namespace net   = boost::asio;  // from <boost/asio.hpp>
+namespace beast = boost::beast; // from <boost/beast.hpp>
+
+/*
+ * Layer between the websocket and the transport socket, it makes sessions detachable and adoptable (see SessionHandoff).
+ *
+ * Normally it just forwards. With tracking enabled it follows the incoming frames and keeps every byte received after the
+ * end of the last message the owner handled (see messageHandled), that is the input a new websocket has to be fed to continue.
+ * While corked, writes are collected and sent together by uncork(), so a batch of small messages costs one system call.
+ * A replay answers the websocket handshake locally, so a stream can take over a connection that is already open,
+ * and then feeds the handed over input before reading from the socket again.
+ */
+template <typename Next> class SessionStream
+{
+    Next next;
+
+    // Frame tracking
+    bool tracking = false;
+    std::string unhandled;
+    // Bytes of unhandled already parsed
+    std::size_t parsed = 0;
+    // Offsets in unhandled where received messages end, oldest first
+    std::deque<std::size_t> message_ends;
+    // The handshake response comes first, frames start after it
+    bool in_response = true;
+    unsigned char header[14];
+    std::size_t header_size = 0, header_needed = 2;
+    std::uint64_t payload_left = 0;
+    bool in_payload = false, message_end = false;
+
+    // Replay
+    bool replaying = false;
+    std::string request, response;
+    std::size_t response_pos = 0;
+    // Input to deliver before reading from the socket
+    std::string injected;
+    std::size_t injected_pos = 0;
+
+    // Cork
+    bool corked = false;
+    std::string corked_output;
+
+    void flushCork(boost::system::error_code &ec)
+    {
+        if (!corked_output.empty())
+            net::write(next, net::buffer(corked_output), ec);
+        corked_output.clear();
+    }
+
+    // Frame is done, a final data frame completes a message
+    void frameDone()
+    {
+        in_payload    = false;
+        header_size   = 0;
+        header_needed = 2;
+        if (message_end)
+            message_ends.push_back(parsed);
+    }
+
+    void trackBytes(const char *data, std::size_t size)
+    {
+        unhandled.append(data, size);
+        if (in_response)
+        {
+            auto end = unhandled.find("\r\n\r\n");
+            if (end == std::string::npos)
+                return;
+            unhandled.erase(0, end + 4);
+            in_response = false;
+        }
+        while (parsed < unhandled.size())
+        {
+            if (in_payload)
+            {
+                std::uint64_t take = std::min<std::uint64_t>(payload_left, unhandled.size() - parsed);
+                parsed += take;
+                payload_left -= take;
+                if (payload_left == 0)
+                    frameDone();
+                continue;
+            }
+            header[header_size++] = (unsigned char) unhandled[parsed++];
+            if (header_size == 2)
+            {
+                // Server frames are never masked
+                unsigned length = header[1] & 0x7F;
+                header_needed   = length == 126 ? 4 : length == 127 ? 10 : 2;
+            }
+            if (header_size < header_needed)
+                continue;
+            unsigned length = header[1] & 0x7F;
+            payload_left    = length;
+            if (length >= 126)
+            {
+                payload_left = 0;
+                for (std::size_t i = 2; i < header_needed; i++)
+                    payload_left = (payload_left << 8) | header[i];
+            }
+            // FIN bit set on a data frame (text, binary or continuation), control frames are interleaved and don't end a message
+            message_end = (header[0] & 0x80) && (header[0] & 0x0F) < 0x8;
+            in_payload  = true;
+            if (payload_left == 0)
+                frameDone();
+        }
+    }
+
+    template <typename Buffers> void track(const Buffers &buffers, std::size_t size)
+    {
+        for (auto it = net::buffer_sequence_begin(buffers); it != net::buffer_sequence_end(buffers) && size; ++it)
+        {
+            net::const_buffer buffer = *it;
+            std::size_t part         = std::min(size, buffer.size());
+            trackBytes(static_cast<const char *>(buffer.data()), part);
+            size -= part;
+        }
+    }
+
+    // Serve the local handshake response, then the injected input. Returns 0 when the socket has to be read.
+    template <typename Buffers> std::size_t readLocal(const Buffers &buffers)
+    {
+        if (replaying)
+        {
+            if (response.empty())
+            {
+                // Answer the key the websocket just sent
+                constexpr std::string_view field = "Sec-WebSocket-Key: ";
+                auto start                       = request.find(field);
+                auto end                         = start == std::string::npos ? start : request.find("\r\n", start);
+                if (end == std::string::npos)
+                    return 0;
+                beast::websocket::detail::sec_ws_accept_type accept;
+                beast::websocket::detail::make_sec_ws_accept(accept, beast::string_view(request).substr(start + field.size(), end - start - field.size()));
+                response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: upgrade\r\nSec-WebSocket-Accept: " + std::string(accept.data(), accept.size()) + "\r\n\r\n";
+            }
+            std::size_t copied = net::buffer_copy(buffers, net::buffer(response.data() + response_pos, response.size() - response_pos));
+            response_pos += copied;
+            return copied;
+        }
+        if (injected_pos >= injected.size())
+            return 0;
+        std::size_t copied = net::buffer_copy(buffers, net::buffer(injected.data() + injected_pos, injected.size() - injected_pos));
+        if (tracking)
+            trackBytes(injected.data() + injected_pos, copied);
+        injected_pos += copied;
+        if (injected_pos == injected.size())
+        {
+            injected.clear();
+            injected_pos = 0;
+        }
+        return copied;
+    }
+
+public:
+    using next_layer_type = Next;
+    using executor_type   = typename Next::executor_type;
+
+    // Collected output is sent early once it reaches this size, larger writes bypass the cork
+    static constexpr std::size_t CORK_LIMIT = 64 * 1024;
+
+    template <typename... Args> explicit SessionStream(Args &&...args) : next(std::forward<Args>(args)...)
+    {
+    }
+
+    Next &next_layer()
+    {
+        return next;
+    }
+    const Next &next_layer() const
+    {
+        return next;
+    }
+    executor_type get_executor()
+    {
+        return next.get_executor();
+    }
+
+    // Must be enabled before the first byte is read
+    void setTracking(bool enabled)
+    {
+        tracking = enabled;
+    }
+
+    // The websocket delivered the oldest received message
+    void messageHandled()
+    {
+        if (message_ends.empty())
+            return;
+        std::size_t end = message_ends.front();
+        message_ends.pop_front();
+        unhandled.erase(0, end);
+        parsed -= end;
+        for (auto &offset : message_ends)
+            offset -= end;
+    }
+
+    // Input received but not handled yet, starting at a message boundary
+    const std::string &unhandledInput() const
+    {
+        return unhandled;
+    }
+
+    // Answer the next handshake locally, input is delivered to the websocket afterwards
+    void beginReplay(std::string input)
+    {
+        replaying   = true;
+        in_response = false;
+        request.clear();
+        response.clear();
+        response_pos = 0;
+        injected     = std::move(input);
+        injected_pos = 0;
+    }
+    void endReplay()
+    {
+        replaying = false;
+    }
+
+    // Only for synchronous writes, they must not be mixed with asynchronous ones until uncorked
+    void cork()
+    {
+        corked = true;
+    }
+    // Send what was collected, ec reports errors of the collected writes
+    void uncork(boost::system::error_code &ec)
+    {
+        ec     = {};
+        corked = false;
+        flushCork(ec);
+    }
+
+    template <typename Buffers> std::size_t read_some(const Buffers &buffers, boost::system::error_code &ec)
+    {
+        ec = {};
+        if (std::size_t local = readLocal(buffers))
+            return local;
+        if (replaying)
+        {
+            ec = net::error::eof;
+            return 0;
+        }
+        std::size_t size = next.read_some(buffers, ec);
+        if (tracking)
+            track(buffers, size);
+        return size;
+    }
+    template <typename Buffers> std::size_t read_some(const Buffers &buffers)
+    {
+        boost::system::error_code ec;
+        std::size_t size = read_some(buffers, ec);
+        if (ec)
+            boost::throw_exception(boost::system::system_error(ec));
+        return size;
+    }
+
+    template <typename Buffers, typename Handler> void async_read_some(const Buffers &buffers, Handler &&handler)
+    {
+        if (std::size_t local = readLocal(buffers))
+        {
+            net::post(get_executor(), beast::bind_front_handler(std::forward<Handler>(handler), boost::system::error_code(), local));
+            return;
+        }
+        if (!tracking)
+        {
+            next.async_read_some(buffers, std::forward<Handler>(handler));
+            return;
+        }
+        auto executor = net::get_associated_executor(handler, get_executor());
+        next.async_read_some(buffers, net::bind_executor(executor, [this, buffers, handler = std::forward<Handler>(handler)](const boost::system::error_code &ec, std::size_t size) mutable {
+                                 // Also called with nothing read when the socket is destroyed, this may be gone then
+                                 if (size)
+                                     track(buffers, size);
+                                 handler(ec, size);
+                             }));
+    }
+
+    template <typename Buffers> std::size_t write_some(const Buffers &buffers, boost::system::error_code &ec)
+    {
+        ec = {};
+        if (replaying)
+        {
+            // The handshake request never goes out
+            std::size_t size = net::buffer_size(buffers);
+            for (auto it = net::buffer_sequence_begin(buffers); it != net::buffer_sequence_end(buffers); ++it)
+            {
+                net::const_buffer buffer = *it;
+                request.append(static_cast<const char *>(buffer.data()), buffer.size());
+            }
+            return size;
+        }
+        if (corked)
+        {
+            std::size_t size = net::buffer_size(buffers);
+            if (corked_output.size() + size > CORK_LIMIT)
+            {
+                flushCork(ec);
+                if (ec)
+                    return 0;
+            }
+            if (size > CORK_LIMIT)
+                return next.write_some(buffers, ec);
+            for (auto it = net::buffer_sequence_begin(buffers); it != net::buffer_sequence_end(buffers); ++it)
+            {
+                net::const_buffer buffer = *it;
+                corked_output.append(static_cast<const char *>(buffer.data()), buffer.size());
+            }
+            return size;
+        }
+        return next.write_some(buffers, ec);
+    }
+    template <typename Buffers> std::size_t write_some(const Buffers &buffers)
+    {
+        boost::system::error_code ec;
+        std::size_t size = write_some(buffers, ec);
+        if (ec)
+            boost::throw_exception(boost::system::system_error(ec));
+        return size;
+    }
+
+    template <typename Buffers, typename Handler> void async_write_some(const Buffers &buffers, Handler &&handler)
+    {
+        next.async_write_some(buffers, std::forward<Handler>(handler));
+    }
+};
+
+// Closing the websocket tears down the transport underneath
+template <typename Next> void teardown(beast::role_type role, SessionStream<Next> &stream, boost::system::error_code &ec)
+{
+    using beast::websocket::teardown;
+    teardown(role, stream.next_layer(), ec);
+}
+
+template <typename Next, typename Handler> void async_teardown(beast::role_type role, SessionStream<Next> &stream, Handler &&handler)
+{
+    using beast::websocket::async_teardown;
+    async_teardown(role, stream.next_layer(), std::forward<Handler>(handler));
+}
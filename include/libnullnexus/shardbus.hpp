@@ -0,0 +1,151 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace net = boost::asio; // from <boost/asio.hpp>
+
+// Unbounded queue for any number of producers and one consumer, push and pop never take a lock.
+// Items pushed by the same producer come out in the order they went in.
+template <typename T> class MpscQueue
+{
+    struct Node
+    {
+        std::atomic<Node *> next{ nullptr };
+        T value;
+    };
+
+    // Producers append here
+    std::atomic<Node *> head;
+    // Consumed up to here, its value is already taken
+    Node *tail;
+
+public:
+    MpscQueue() : head(new Node), tail(head.load())
+    {
+    }
+    MpscQueue(const MpscQueue &) = delete;
+
+    ~MpscQueue()
+    {
+        while (tail)
+        {
+            Node *next = tail->next.load();
+            delete tail;
+            tail = next;
+        }
+    }
+
+    void push(T value)
+    {
+        Node *node  = new Node;
+        node->value = std::move(value);
+        Node *prev  = head.exchange(node, std::memory_order_acq_rel);
+        // Until this store the consumer doesn't see node, it finds the queue empty
+        prev->next.store(node, std::memory_order_seq_cst);
+    }
+
+    // Consumer only
+    bool pop(T &value)
+    {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (!next)
+            return false;
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+    // Consumer only
+    bool empty() const
+    {
+        return tail->next.load(std::memory_order_seq_cst) == nullptr;
+    }
+};
+
+/*
+ * Carries events between shards, each running on its own io_context.
+ *
+ * Every shard has an MpscQueue, publishing pushes the event to the queue of every other shard.
+ * The first event pushed to an idle shard posts one drain to its io_context, later ones ride along with it,
+ * so a burst of broadcasts costs each shard one wakeup.
+ * Shards have to be added before anything is published, the bus must outlive the io_contexts.
+ */
+template <typename Event> class ShardBus
+{
+    struct Shard
+    {
+        net::io_context &ioc;
+        std::function<void(const Event &)> handler;
+        MpscQueue<Event> queue;
+        // A drain is posted and not finished yet
+        std::atomic<bool> scheduled{ false };
+
+        Shard(net::io_context &ioc, std::function<void(const Event &)> handler) : ioc(ioc), handler(std::move(handler))
+        {
+        }
+    };
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    // Events handled per drain, more are left to another one so the shard's sockets get their turn
+    static constexpr std::size_t DRAIN_BATCH = 256;
+
+    static void wake(Shard &shard)
+    {
+        if (!shard.scheduled.exchange(true))
+            net::post(shard.ioc, [&shard]() { drain(shard); });
+    }
+
+    static void drain(Shard &shard)
+    {
+        Event event;
+        for (std::size_t i = 0; i < DRAIN_BATCH; i++)
+        {
+            if (!shard.queue.pop(event))
+            {
+                shard.scheduled.store(false);
+                // An event pushed before the flag was cleared found it set and didn't wake us
+                if (!shard.queue.empty())
+                    wake(shard);
+                return;
+            }
+            shard.handler(event);
+        }
+        net::post(shard.ioc, [&shard]() { drain(shard); });
+    }
+
+public:
+    // handler runs on ioc for every event published by another shard. Returns the index of the new shard.
+    std::size_t addShard(net::io_context &ioc, std::function<void(const Event &)> handler)
+    {
+        shards.push_back(std::make_unique<Shard>(ioc, std::move(handler)));
+        return shards.size() - 1;
+    }
+
+    std::size_t shardCount() const
+    {
+        return shards.size();
+    }
+
+    // Deliver event to every shard except origin, from any thread
+    void publish(std::size_t origin, const Event &event)
+    {
+        for (std::size_t i = 0; i < shards.size(); i++)
+        {
+            if (i == origin)
+                continue;
+            shards[i]->queue.push(event);
+            wake(*shards[i]);
+        }
+    }
+};
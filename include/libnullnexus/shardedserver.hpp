@@ -0,0 +1,125 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "server.hpp"
+#include "shardbus.hpp"
+#include "threadoptions.hpp"
+
+#include <boost/asio/executor_work_guard.hpp>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+/*
+ * NullNexusServer spread over several cores, for servers and relays with more clients than one io_context can serve.
+ *
+ * Every shard is a NullNexusServer with its own io_context and thread, listening on the same endpoint with SO_REUSEPORT,
+ * so the kernel spreads connections between them and nothing is shared on the accept or read path.
+ * Broadcasts are serialized once by the shard that received them and go to the others over a ShardBus;
+ * game membership is replicated the same way, so every shard computes authedplayers for its own clients only.
+ *
+ * Needs SO_REUSEPORT (linux), elsewhere listening fails with more than one shard.
+ * Like BasicRuntime, it must not be destroyed from one of its own threads.
+ */
+class ShardedNullNexusServer
+{
+    struct Shard
+    {
+        net::io_context ioc;
+        net::executor_work_guard<net::io_context::executor_type> work;
+        NullNexusServer server;
+
+        explicit Shard(const ServerOptions &options) : work(ioc.get_executor()), server(ioc, options)
+        {
+        }
+    };
+
+    // Outlives the shards, drains may still be queued on their io_contexts
+    ShardBus<ServerEvent> bus;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<std::thread> threads;
+
+    static void runShard(Shard &shard, const ThreadOptions &thread_options)
+    {
+        thread_options.apply();
+        shard.ioc.run();
+    }
+
+public:
+    // shard_count 0 means one per core. If thread_options lists cpus, shard i is pinned to the i-th of them (wrapping around).
+    ShardedNullNexusServer(std::size_t shard_count = 0, ServerOptions options = ServerOptions(), ThreadOptions thread_options = ThreadOptions())
+    {
+        if (!shard_count)
+            shard_count = std::max(1u, std::thread::hardware_concurrency());
+        options.reuse_port = true;
+        for (std::size_t i = 0; i < shard_count; i++)
+        {
+            shards.push_back(std::make_unique<Shard>(options));
+            auto &server = shards.back()->server;
+            bus.addShard(shards.back()->ioc, [&server](const ServerEvent &event) { server.deliver(event); });
+            // Member ids of different shards never collide
+            server.setPublisher([this, i](const ServerEvent &event) { bus.publish(i, event); }, std::uint64_t(i) << 48);
+        }
+        for (std::size_t i = 0; i < shard_count; i++)
+        {
+            ThreadOptions shard_options = thread_options;
+            if (!thread_options.cpus.empty())
+                shard_options.cpus = { thread_options.cpus[i % thread_options.cpus.size()] };
+            threads.emplace_back(&ShardedNullNexusServer::runShard, std::ref(*shards[i]), shard_options);
+        }
+    }
+    ShardedNullNexusServer(const ShardedNullNexusServer &) = delete;
+
+    // Start accepting clients on endpoint with every shard. Port 0 picks one port for all of them.
+    bool listen(tcp::endpoint endpoint, boost::system::error_code &ec)
+    {
+        for (auto &shard : shards)
+        {
+            if (!shard->server.listen(endpoint, ec))
+            {
+                stop();
+                return false;
+            }
+            endpoint = shard->server.localEndpoint();
+        }
+        return true;
+    }
+
+    tcp::endpoint localEndpoint()
+    {
+        return shards.front()->server.localEndpoint();
+    }
+
+    // Stop accepting and disconnect everyone
+    void stop()
+    {
+        for (auto &shard : shards)
+            shard->server.stop();
+    }
+
+    std::size_t shardCount() const
+    {
+        return shards.size();
+    }
+
+    std::size_t clientCount()
+    {
+        std::size_t count = 0;
+        for (auto &shard : shards)
+            count += shard->server.clientCount();
+        return count;
+    }
+
+    // Waits for the connections to close, call stop() first to close them
+    ~ShardedNullNexusServer()
+    {
+        for (auto &shard : shards)
+            shard->work.reset();
+        for (auto &thread : threads)
+            thread.join();
+    }
+};
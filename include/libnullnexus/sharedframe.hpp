@@ -0,0 +1,45 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace net = boost::asio; // from <boost/asio.hpp>
+
+// Immutable message, serialized once and then sent on any number of connections.
+// Copies share the payload through a reference count, queueing it for another recipient copies nothing.
+// Clients mask every frame with a fresh key, so only the payload can be shared there; a server writes it as is.
+class SharedFrame
+{
+    std::shared_ptr<const std::string> payload;
+
+public:
+    SharedFrame() = default;
+    explicit SharedFrame(std::string data) : payload(std::make_shared<const std::string>(std::move(data)))
+    {
+    }
+
+    explicit operator bool() const
+    {
+        return payload != nullptr;
+    }
+
+    std::string_view view() const
+    {
+        return payload ? std::string_view(*payload) : std::string_view();
+    }
+    net::const_buffer buffer() const
+    {
+        return payload ? net::buffer(*payload) : net::const_buffer();
+    }
+    std::size_t size() const
+    {
+        return payload ? payload->size() : 0;
+    }
+};
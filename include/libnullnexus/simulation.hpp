@@ -0,0 +1,161 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "clock.hpp"
+#include "websocketclient.hpp"
+
+#include <boost/beast/_experimental/test/stream.hpp>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Simulated network for testing reconnect and timing behaviour without sockets or wall clock waits.
+ * Use together with SimulatedClock:
+ *
+ *   SimulatedNetwork network(server_ioc, [](std::shared_ptr<beast::test::stream> server_end) { ... accept the websocket ... });
+ *   BasicWebSocketClient<SimulatedTransport, SimulatedClock> client(SimulatedTransport(network), "/api/v1/client", callback);
+ *   network.setReachable(false);
+ *   client.start(true);
+ *   SimulatedClock::advance(std::chrono::seconds(RESTART_WAIT_TIME)); // Retry happens instantly
+ *
+ * Connection attempts complete after the configured (virtual) connect latency. Every accepted connection hands its
+ * server end to the accept handler on the server io_context.
+ */
+class SimulatedNetwork
+{
+    net::io_context &server_ioc;
+    std::function<void(std::shared_ptr<beast::test::stream>)> on_accept;
+
+    std::mutex mutex;
+    bool reachable = true;
+    SimulatedClock::duration connect_latency{};
+    // Pending connection attempts by client socket
+    std::map<beast::test::stream *, std::shared_ptr<SimulatedClock::timer>> pending;
+    std::vector<std::weak_ptr<beast::test::stream>> connections;
+    // Server end of every connected client socket
+    std::map<beast::test::stream *, std::weak_ptr<beast::test::stream>> peers;
+    std::size_t attempts = 0;
+
+public:
+    SimulatedNetwork(net::io_context &server_ioc, std::function<void(std::shared_ptr<beast::test::stream>)> on_accept) : server_ioc(server_ioc), on_accept(on_accept)
+    {
+    }
+
+    // Unreachable networks refuse all connection attempts
+    void setReachable(bool value)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reachable = value;
+    }
+
+    void setConnectLatency(SimulatedClock::duration latency)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        connect_latency = latency;
+    }
+
+    // Cut all established connections, clients see the server closing the stream
+    void dropAll()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &weak : connections)
+            if (auto connection = weak.lock())
+                connection->close();
+        connections.clear();
+    }
+
+    // Connection attempts made so far
+    std::size_t connectionAttempts()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return attempts;
+    }
+
+    template <typename Handler> void connect(beast::test::stream &socket, Handler handler)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        attempts++;
+        auto timer = std::make_shared<SimulatedClock::timer>(socket.get_executor().context());
+        pending[&socket] = timer;
+        timer->expires_after(connect_latency);
+        timer->async_wait([this, &socket, handler](const boost::system::error_code &ec) mutable {
+            std::unique_lock<std::mutex> lock(mutex);
+            pending.erase(&socket);
+            if (ec)
+            {
+                lock.unlock();
+                handler(ec);
+                return;
+            }
+            if (!reachable)
+            {
+                lock.unlock();
+                handler(net::error::connection_refused);
+                return;
+            }
+            auto server_end = std::make_shared<beast::test::stream>(server_ioc);
+            socket.connect(*server_end);
+            connections.push_back(server_end);
+            peers[&socket] = server_end;
+            net::post(server_ioc, std::bind(on_accept, server_end));
+            lock.unlock();
+            handler(boost::system::error_code());
+        });
+    }
+
+    // Aborts a connection attempt in progress, or the pending operations of a connected socket.
+    // Test streams can't just cancel, the connection is closed from both ends so reads started later fail as well.
+    void cancel(beast::test::stream &socket)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pending.find(&socket);
+        if (it != pending.end())
+        {
+            it->second->cancel();
+            return;
+        }
+        socket.close();
+        auto peer = peers.find(&socket);
+        if (peer == peers.end())
+            return;
+        if (auto server_end = peer->second.lock())
+            server_end->close();
+        peers.erase(peer);
+    }
+};
+
+// Transport connecting through a SimulatedNetwork
+struct SimulatedTransport
+{
+    using socket_type = beast::test::stream;
+
+    SimulatedNetwork *network;
+    std::string host = "simulated";
+
+    SimulatedTransport(SimulatedNetwork &network) : network(&network)
+    {
+    }
+
+    const std::string &handshakeHost() const
+    {
+        return host;
+    }
+
+    template <typename Handler> void asyncConnect(socket_type &socket, Handler handler)
+    {
+        network->connect(socket, handler);
+    }
+
+    void cancel(socket_type &socket)
+    {
+        network->cancel(socket);
+    }
+};
+
+using SimulatedWebSocketClient = BasicWebSocketClient<SimulatedTransport, SimulatedClock>;
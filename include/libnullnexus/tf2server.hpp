@@ -0,0 +1,176 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <boost/asio/ip/address.hpp>
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace net = boost::asio; // from <boost/asio.hpp>
+
+/*
+ * Game server a user is on, plus the user's own SteamID64 on it. Used for authenticating with other nullnexus users.
+ *
+ * Stored packed (address bytes, port, SteamID64) with a hash computed on construction,
+ * so comparing two of them every tick is cheap. The string forms are only built when sending.
+ * Values that can't be parsed (hostnames, SteamID3, ...) are kept as given and sent unchanged.
+ */
+class TF2Server
+{
+    // Text of fields that didn't parse, empty otherwise. Declared first, parsing the others fills them in.
+    std::string raw_ip, raw_port, raw_steamid;
+    // IPv4 addresses use the first 4 bytes
+    std::array<std::uint8_t, 16> address_bytes{};
+    // 0 if unknown, 4 or 6 otherwise
+    std::uint8_t address_family = 0;
+    bool is_connected           = false;
+    std::uint16_t port_number   = 0;
+    std::uint64_t steamid64     = 0;
+    int spawn_count             = -1;
+    std::size_t hash_value      = 0;
+
+    void setAddress(const net::ip::address &address)
+    {
+        if (address.is_v4())
+        {
+            auto bytes = address.to_v4().to_bytes();
+            std::memcpy(address_bytes.data(), bytes.data(), bytes.size());
+            address_family = 4;
+        }
+        else
+        {
+            auto bytes = address.to_v6().to_bytes();
+            std::memcpy(address_bytes.data(), bytes.data(), bytes.size());
+            address_family = 6;
+        }
+    }
+
+    // Zero isn't a valid port or steamid, it is kept as text like anything else that doesn't parse
+    template <typename T> static T parseNumber(std::string_view text, std::string &raw)
+    {
+        T value{};
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (result.ec != std::errc() || result.ptr != text.data() + text.size() || value == T{})
+        {
+            raw = text;
+            return T{};
+        }
+        return value;
+    }
+
+    void computeHash()
+    {
+        auto mix = [this](std::uint64_t value) { hash_value ^= value + 0x9e3779b97f4a7c15ULL + (hash_value << 6) + (hash_value >> 2); };
+        std::uint64_t high, low;
+        std::memcpy(&high, address_bytes.data(), 8);
+        std::memcpy(&low, address_bytes.data() + 8, 8);
+        mix(high);
+        mix(low);
+        mix((std::uint64_t(address_family) << 32) | (std::uint64_t(is_connected) << 16) | port_number);
+        mix(steamid64);
+        mix(std::uint32_t(spawn_count));
+        for (auto *raw : { &raw_ip, &raw_port, &raw_steamid })
+            if (!raw->empty())
+                mix(std::hash<std::string>()(*raw));
+    }
+
+public:
+    // From the usual string forms: numeric IPv4/IPv6 address, port number and SteamID64
+    TF2Server(bool connected = false, std::string_view ip = "", std::string_view port = "", std::string_view steamid = "", int server_spawn_count = -1) : is_connected(connected), port_number(parseNumber<std::uint16_t>(port, raw_port)), steamid64(parseNumber<std::uint64_t>(steamid, raw_steamid)), spawn_count(server_spawn_count)
+    {
+        boost::system::error_code ec;
+        auto address = net::ip::make_address(std::string(ip), ec);
+        if (!ec)
+            setAddress(address);
+        else
+            raw_ip = ip;
+        computeHash();
+    }
+    // From values the game already has in binary form, nothing to parse
+    TF2Server(bool connected, const net::ip::address &address, std::uint16_t port, std::uint64_t steamid, int server_spawn_count) : is_connected(connected), port_number(port), steamid64(steamid), spawn_count(server_spawn_count)
+    {
+        setAddress(address);
+        computeHash();
+    }
+
+    bool operator==(const TF2Server &other) const
+    {
+        // Differing hashes settle almost every comparison
+        return hash_value == other.hash_value && is_connected == other.is_connected && address_family == other.address_family && port_number == other.port_number && steamid64 == other.steamid64 && spawn_count == other.spawn_count && address_bytes == other.address_bytes && raw_ip == other.raw_ip && raw_port == other.raw_port && raw_steamid == other.raw_steamid;
+    }
+    bool operator!=(const TF2Server &other) const
+    {
+        return !(*this == other);
+    }
+
+    bool connected() const
+    {
+        return is_connected;
+    }
+    std::uint16_t port() const
+    {
+        return port_number;
+    }
+    std::uint64_t steamid() const
+    {
+        return steamid64;
+    }
+    int serverSpawnCount() const
+    {
+        return spawn_count;
+    }
+    std::size_t hash() const
+    {
+        return hash_value;
+    }
+
+    // String forms as sent to the server, empty if unknown
+    std::string ipString() const
+    {
+        if (!raw_ip.empty())
+            return raw_ip;
+        if (address_family == 4)
+        {
+            net::ip::address_v4::bytes_type bytes;
+            std::memcpy(bytes.data(), address_bytes.data(), bytes.size());
+            return net::ip::address_v4(bytes).to_string();
+        }
+        if (address_family == 6)
+        {
+            net::ip::address_v6::bytes_type bytes;
+            std::memcpy(bytes.data(), address_bytes.data(), bytes.size());
+            return net::ip::address_v6(bytes).to_string();
+        }
+        return "";
+    }
+    std::string portString() const
+    {
+        return port_number ? std::to_string(port_number) : raw_port;
+    }
+    std::string steamidString() const
+    {
+        return steamid64 ? std::to_string(steamid64) : raw_steamid;
+    }
+
+    // Identifies one run of a game server, a server restart or map change bumps the spawn count
+    std::string identity() const
+    {
+        return ipString() + ":" + portString() + "#" + std::to_string(spawn_count);
+    }
+};
+
+template <> struct std::hash<TF2Server>
+{
+    std::size_t operator()(const TF2Server &server) const
+    {
+        return server.hash();
+    }
+};
@@ -0,0 +1,70 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <optional>
+#include <string>
+#include <vector>
+
+// Scheduling settings for the IO worker thread(s)
+struct ThreadOptions
+{
+    // Thread name shown by profilers and debuggers. Linux truncates it to 15 characters.
+    std::string name = "nullnexus-io";
+    // CPUs the thread may run on, empty means no restriction. Numbers outside 0 to CPU_SETSIZE - 1 are skipped and make apply() fail.
+    std::vector<int> cpus;
+    // Scheduling policy (SCHED_OTHER, SCHED_FIFO, SCHED_RR, SCHED_BATCH, SCHED_IDLE) and its priority, see sched(7)
+    std::optional<int> sched_policy;
+    int sched_priority = 0;
+    // Nice value of the thread (not the whole process)
+    std::optional<int> nice;
+
+    // Apply the settings to the calling thread. Returns false if any of them could not be applied,
+    // the remaining ones are still attempted.
+    bool apply() const
+    {
+        bool ok = true;
+#ifdef __linux__
+        if (!name.empty())
+            ok &= pthread_setname_np(pthread_self(), name.substr(0, 15).c_str()) == 0;
+        if (!cpus.empty())
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            bool any = false;
+            for (int cpu : cpus)
+            {
+                if (cpu < 0 || cpu >= CPU_SETSIZE)
+                {
+                    ok = false;
+                    continue;
+                }
+                CPU_SET(cpu, &set);
+                any = true;
+            }
+            if (any)
+                ok &= pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+        }
+        if (sched_policy)
+        {
+            sched_param param{};
+            param.sched_priority = sched_priority;
+            ok &= pthread_setschedparam(pthread_self(), *sched_policy, &param) == 0;
+        }
+        // On linux the nice value is a per-thread attribute, addressed by the thread id
+        if (nice)
+            ok &= setpriority(PRIO_PROCESS, syscall(SYS_gettid), *nice) == 0;
+#endif
+        return ok;
+    }
+};
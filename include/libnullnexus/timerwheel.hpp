@@ -0,0 +1,276 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "clock.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/*
+ * Hierarchical timer wheel (4 levels of 64 slots) running on top of a single Clock::timer.
+ *
+ * Scheduling and cancelling are O(1). Time is counted in ticks of a fixed resolution, timers due in the same tick
+ * fire together in one wakeup. The underlying timer is only armed while timers are scheduled, so an empty wheel causes no wakeups.
+ * Delays longer than the wheel span (64^4 ticks) are clamped to it.
+ *
+ * Thread safe. Callbacks run on a thread of the io_context the wheel was created with, without any lock held.
+ */
+template <typename Clock> class TimerWheel
+{
+    static constexpr int LEVELS         = 4;
+    static constexpr int SLOT_BITS      = 6;
+    static constexpr std::uint64_t SLOTS = 1 << SLOT_BITS;
+    static constexpr std::uint64_t MASK  = SLOTS - 1;
+
+    struct Node
+    {
+        Node *prev = nullptr, *next = nullptr;
+        Node **slot = nullptr;
+        int level   = 0;
+        std::uint64_t expiry = 0;
+        std::function<void()> callback;
+    };
+
+public:
+    class Timer
+    {
+        friend class TimerWheel;
+        TimerWheel &wheel;
+        Node node;
+
+    public:
+        Timer(TimerWheel &wheel) : wheel(wheel)
+        {
+        }
+        Timer(const Timer &) = delete;
+        ~Timer()
+        {
+            cancel();
+        }
+
+        // Run callback after delay, replaces anything scheduled before
+        template <typename Duration> void schedule(Duration delay, std::function<void()> callback)
+        {
+            wheel.schedule(node, std::chrono::duration_cast<typename Clock::duration>(delay), std::move(callback));
+        }
+
+        // Returns true if a scheduled callback was removed. It is guaranteed not to run then.
+        // False means nothing was scheduled or the callback already fired (or is about to).
+        bool cancel()
+        {
+            return wheel.cancel(node);
+        }
+    };
+
+private:
+    typename Clock::duration resolution;
+    typename Clock::time_point epoch;
+
+    std::mutex mutex;
+    std::array<std::array<Node *, SLOTS>, LEVELS> slots{};
+    std::array<std::size_t, LEVELS> counts{};
+    // Last tick that has been processed
+    std::uint64_t current = 0;
+
+    typename Clock::timer driver;
+    // Tick the driver is armed for, if armed
+    bool armed            = false;
+    std::uint64_t armed_for = 0;
+
+    std::uint64_t toTick(typename Clock::time_point time) const
+    {
+        if (time <= epoch)
+            return 0;
+        return std::uint64_t((time - epoch) / resolution);
+    }
+
+    // Ticks before first have been processed, due (or overdue) timers fire on first. Needs the mutex to be held
+    void link(Node &node, std::uint64_t first)
+    {
+        if (node.expiry < first)
+            node.expiry = first;
+        std::uint64_t delta = node.expiry - current;
+        int level           = 0;
+        while (level < LEVELS - 1 && delta >= (std::uint64_t(1) << (SLOT_BITS * (level + 1))))
+            level++;
+        // Clamp to the span of the wheel
+        if (delta >= (std::uint64_t(1) << (SLOT_BITS * LEVELS)))
+            node.expiry = current + (std::uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+        Node *&head = slots[level][(node.expiry >> (SLOT_BITS * level)) & MASK];
+        node.prev   = nullptr;
+        node.next   = head;
+        if (head)
+            head->prev = &node;
+        head       = &node;
+        node.slot  = &head;
+        node.level = level;
+        counts[level]++;
+    }
+
+    // Needs the mutex to be held
+    void unlink(Node &node)
+    {
+        if (node.prev)
+            node.prev->next = node.next;
+        else
+            *node.slot = node.next;
+        if (node.next)
+            node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+        node.slot             = nullptr;
+        counts[node.level]--;
+    }
+
+    // Move the timers of the slot level has reached at tick down to lower levels, needs the mutex to be held
+    void cascade(std::uint64_t tick, int level)
+    {
+        if (level >= LEVELS)
+            return;
+        std::uint64_t index = (tick >> (SLOT_BITS * level)) & MASK;
+        // Higher levels first, their timers may belong into this slot
+        if (index == 0)
+            cascade(tick, level + 1);
+        Node *node = slots[level][index];
+        while (node)
+        {
+            Node *next = node->next;
+            unlink(*node);
+            // The slot of the current tick is collected after the cascade, timers due now still fire on it
+            link(*node, current);
+            node = next;
+        }
+    }
+
+    // Process all ticks up to target and collect the callbacks that are due, needs the mutex to be held
+    void advance(std::uint64_t target, std::vector<std::function<void()>> &due)
+    {
+        while (current < target)
+        {
+            if (counts[0] == 0 && counts[1] == 0 && counts[2] == 0 && counts[3] == 0)
+            {
+                current = target;
+                break;
+            }
+            // Nothing on the lowest level, skip to the next cascade
+            if (counts[0] == 0)
+            {
+                std::uint64_t boundary = (current | MASK) + 1;
+                if (boundary > target)
+                {
+                    current = target;
+                    break;
+                }
+                current = boundary - 1;
+            }
+            current++;
+            if ((current & MASK) == 0)
+                cascade(current, 1);
+            Node *&head = slots[0][current & MASK];
+            while (head)
+            {
+                Node *node = head;
+                unlink(*node);
+                due.push_back(std::move(node->callback));
+                node->callback = nullptr;
+            }
+        }
+    }
+
+    // Next tick the wheel has to look at: the first due timer or the first cascade of a non-empty slot.
+    // Needs the mutex to be held
+    std::uint64_t nextTick() const
+    {
+        std::uint64_t next = UINT64_MAX;
+        for (int level = 0; level < LEVELS; level++)
+        {
+            if (!counts[level])
+                continue;
+            std::uint64_t base = current >> (SLOT_BITS * level);
+            for (std::uint64_t offset = 1; offset <= SLOTS; offset++)
+                if (slots[level][(base + offset) & MASK])
+                {
+                    next = std::min(next, (base + offset) << (SLOT_BITS * level));
+                    break;
+                }
+        }
+        return next;
+    }
+
+    // Make sure the driver wakes us up in time, needs the mutex to be held
+    void arm()
+    {
+        if (counts[0] == 0 && counts[1] == 0 && counts[2] == 0 && counts[3] == 0)
+        {
+            if (armed)
+                driver.cancel();
+            armed = false;
+            return;
+        }
+        std::uint64_t tick = nextTick();
+        if (armed && armed_for <= tick)
+            return;
+        armed     = true;
+        armed_for = tick;
+        auto now  = Clock::now();
+        auto when = epoch + resolution * typename Clock::rep(tick);
+        driver.expires_after(when > now ? when - now : Clock::duration::zero());
+        driver.async_wait(std::bind(&TimerWheel::onDriver, this, std::placeholders::_1, tick));
+    }
+
+    void onDriver(const boost::system::error_code &ec, std::uint64_t tick)
+    {
+        std::vector<std::function<void()>> due;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // Replaced by an earlier wakeup
+            if (ec || !armed || armed_for != tick)
+                return;
+            armed = false;
+            advance(toTick(Clock::now()), due);
+            arm();
+        }
+        for (auto &callback : due)
+            callback();
+    }
+
+    template <typename Duration> void schedule(Node &node, Duration delay, std::function<void()> callback)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (node.slot)
+            unlink(node);
+        // First tick at or after now + delay, timers never fire early. Rounding now down to its tick first would.
+        auto now      = Clock::now();
+        auto due      = std::max<typename Clock::duration>(now + delay - epoch, Clock::duration::zero());
+        node.expiry   = std::uint64_t((due + resolution - typename Clock::duration(1)) / resolution);
+        node.callback = std::move(callback);
+        // Catch up first so the new timer is placed relative to the present
+        if (toTick(now) > current && counts == decltype(counts){})
+            current = toTick(now);
+        link(node, current + 1);
+        arm();
+    }
+
+    bool cancel(Node &node)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!node.slot)
+            return false;
+        unlink(node);
+        node.callback = nullptr;
+        arm();
+        return true;
+    }
+
+public:
+    TimerWheel(net::io_context &ioc, typename Clock::duration resolution = std::chrono::milliseconds(10)) : resolution(resolution), epoch(Clock::now()), driver(ioc)
+    {
+    }
+    TimerWheel(const TimerWheel &) = delete;
+};
@@ -0,0 +1,146 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#ifdef __linux__
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include <cerrno>
+#include <sys/socket.h>
+#endif
+
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace net = boost::asio;          // from <boost/asio.hpp>
+using tcp     = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+#ifdef __linux__
+namespace local = boost::asio::local;
+#endif
+
+/*
+ * Transports used by BasicWebSocketClient.
+ *
+ * A transport describes how to get a connected byte stream for the websocket to run on:
+ *  - socket_type:                        Stream type the websocket is layered on top of, constructible from an io_context
+ *  - handshakeHost():                    Value of the Host header sent during the websocket handshake
+ *  - asyncConnect(socket, handler):      Connect the socket, handler(const boost::system::error_code &) is called when done
+ *  - cancel(socket):                     Abort a pending connection attempt (may be static)
+ *
+ * Transports whose connections can be handed to another client (see SessionHandoff) also have:
+ *  - release(socket, ec):                Take the file descriptor out of a connected socket without closing the connection
+ *  - adopt(socket, fd, ec):              Make a fresh socket use a connected file descriptor
+ */
+
+// Plain TCP connection to host:port
+struct TcpTransport
+{
+    using socket_type = tcp::socket;
+
+    std::string host, port;
+
+    TcpTransport(std::string host, std::string port) : host(host), port(port)
+    {
+    }
+
+    const std::string &handshakeHost() const
+    {
+        return host;
+    }
+
+    template <typename Handler> void asyncConnect(socket_type &socket, Handler handler)
+    {
+        boost::system::error_code ec;
+        tcp::resolver resolver{ socket.get_executor() };
+
+        // Look up the domain name
+        auto const results = resolver.resolve(host, port, ec);
+        if (ec)
+        {
+            handler(ec);
+            return;
+        }
+        net::async_connect(socket, results.begin(), results.end(), [handler](const boost::system::error_code &ec, auto) mutable { handler(ec); });
+    }
+
+    static void cancel(socket_type &socket)
+    {
+        boost::system::error_code ec;
+        socket.cancel(ec);
+    }
+
+#ifdef __linux__
+    static int release(socket_type &socket, boost::system::error_code &ec)
+    {
+        return socket.release(ec);
+    }
+
+    static void adopt(socket_type &socket, int fd, boost::system::error_code &ec)
+    {
+        // The protocol has to match the address family of the connection
+        sockaddr_storage address{};
+        socklen_t length = sizeof(address);
+        if (::getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+        {
+            ec = boost::system::error_code(errno, boost::system::system_category());
+            return;
+        }
+        socket.assign(address.ss_family == AF_INET6 ? tcp::v6() : tcp::v4(), fd, ec);
+    }
+#endif
+};
+
+#ifdef __linux__
+// Unix domain socket connection, the socket path doubles as the handshake host
+struct UnixTransport
+{
+    using socket_type = local::stream_protocol::socket;
+
+    std::string path;
+
+    UnixTransport(std::string path) : path(path)
+    {
+    }
+
+    const std::string &handshakeHost() const
+    {
+        return path;
+    }
+
+    template <typename Handler> void asyncConnect(socket_type &socket, Handler handler)
+    {
+        boost::system::error_code ec;
+        socket.connect(local::stream_protocol::endpoint(path), ec);
+        handler(ec);
+    }
+
+    static void cancel(socket_type &socket)
+    {
+        boost::system::error_code ec;
+        socket.cancel(ec);
+    }
+
+    static int release(socket_type &socket, boost::system::error_code &ec)
+    {
+        return socket.release(ec);
+    }
+
+    static void adopt(socket_type &socket, int fd, boost::system::error_code &ec)
+    {
+        socket.assign(local::stream_protocol(), fd, ec);
+    }
+};
+#endif
+
+// Does Transport support release() and adopt()?
+template <typename Transport, typename = void> struct TransportSupportsHandoff : std::false_type
+{
+};
+template <typename Transport> struct TransportSupportsHandoff<Transport, std::void_t<decltype(Transport::release(std::declval<typename Transport::socket_type &>(), std::declval<boost::system::error_code &>())), decltype(Transport::adopt(std::declval<typename Transport::socket_type &>(), 0, std::declval<boost::system::error_code &>()))>> : std::true_type
+{
+};
@@ -0,0 +1,182 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Interning table for usernames plus the last known metadata of every user.
+// Holds up to max_users names, after that the least recently used one (second chance approximation) makes room.
+// Ids carry the generation of their slot, an id of an evicted user is stale and looks unknown from then on.
+// Safe to use from multiple threads.
+class UserDirectory
+{
+public:
+    using UserId                        = std::uint32_t;
+    static constexpr UserId INVALID_USER = UINT32_MAX;
+
+    struct UserInfo
+    {
+        std::optional<int> colour;
+        // From dataupdates: the users steamid and the game server they are on
+        std::optional<std::string> steamid;
+        std::optional<std::string> server_ip, server_port;
+    };
+
+private:
+    // Low bits of an id are the slot, the rest its generation. Generations wrap after 4096 reuses of a slot.
+    static constexpr unsigned SLOT_BITS     = 20;
+    static constexpr UserId SLOT_MASK       = (UserId(1) << SLOT_BITS) - 1;
+    static constexpr std::size_t SLOT_LIMIT = SLOT_MASK;
+
+    struct Entry
+    {
+        std::string name;
+        UserInfo info;
+        UserId generation = 0;
+        // Used again since it was added or the clock hand last passed, set without the exclusive lock.
+        // A name seen only once is the first to go, so a flood of new names can't push out the regulars.
+        mutable std::atomic<bool> referenced{ false };
+    };
+
+    // Deque so entries never move, the map keys point into them
+    std::deque<Entry> entries;
+    std::unordered_map<std::string_view, UserId> ids;
+    std::size_t max_users;
+    // Next eviction candidate
+    std::size_t hand = 0;
+    mutable std::shared_mutex mutex;
+
+    static UserId makeId(std::size_t slot, UserId generation)
+    {
+        return (generation << SLOT_BITS) | UserId(slot);
+    }
+    // Entry of id unless it is stale, needs the lock
+    const Entry *lookup(UserId id) const
+    {
+        std::size_t slot = id & SLOT_MASK;
+        if (slot >= entries.size() || entries[slot].generation != id >> SLOT_BITS)
+            return nullptr;
+        return &entries[slot];
+    }
+    Entry *lookup(UserId id)
+    {
+        return const_cast<Entry *>(static_cast<const UserDirectory *>(this)->lookup(id));
+    }
+
+    // Slot for a new name, needs the exclusive lock
+    std::size_t allocate()
+    {
+        if (entries.size() < max_users)
+        {
+            entries.emplace_back();
+            return entries.size() - 1;
+        }
+        // Skip entries used since the last pass, clearing their mark on the way
+        while (entries[hand].referenced.exchange(false, std::memory_order_relaxed))
+            hand = (hand + 1) % entries.size();
+        std::size_t slot = hand;
+        hand             = (hand + 1) % entries.size();
+        auto &entry      = entries[slot];
+        ids.erase(entry.name);
+        entry.generation = (entry.generation + 1) & (UINT32_MAX >> SLOT_BITS);
+        entry.info       = {};
+        return slot;
+    }
+
+public:
+    // Protects against a server flooding us with names, memory stays bounded by max_users
+    UserDirectory(std::size_t max_users = 4096) : max_users(std::min(max_users, SLOT_LIMIT))
+    {
+    }
+
+    std::optional<UserId> find(std::string_view name) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = ids.find(name);
+        if (it == ids.end())
+            return std::nullopt;
+        entries[it->second & SLOT_MASK].referenced.store(true, std::memory_order_relaxed);
+        return it->second;
+    }
+
+    // Id of name, adding it if needed and evicting a user that wasn't seen for a while if full.
+    // Returns INVALID_USER only if max_users is 0.
+    UserId intern(std::string_view name)
+    {
+        if (auto id = find(name))
+            return *id;
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        // Someone else might have added it in the meantime
+        auto it = ids.find(name);
+        if (it != ids.end())
+            return it->second;
+        if (!max_users)
+            return INVALID_USER;
+        std::size_t slot = allocate();
+        auto &entry      = entries[slot];
+        entry.name       = name;
+        UserId id        = makeId(slot, entry.generation);
+        ids.emplace(entry.name, id);
+        return id;
+    }
+
+    // Empty for unknown or stale ids
+    std::string name(UserId id) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto *entry = lookup(id);
+        return entry ? entry->name : std::string();
+    }
+
+    std::optional<UserInfo> info(UserId id) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto *entry = lookup(id);
+        if (!entry)
+            return std::nullopt;
+        return entry->info;
+    }
+
+    // False if id is unknown or stale
+    bool isValid(UserId id) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return lookup(id) != nullptr;
+    }
+
+    void setColour(UserId id, int colour)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (auto *entry = lookup(id))
+            entry->info.colour = colour;
+    }
+
+    void setServer(UserId id, std::optional<std::string> steamid, std::optional<std::string> server_ip, std::optional<std::string> server_port)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto *entry = lookup(id);
+        if (!entry)
+            return;
+        auto &info       = entry->info;
+        info.steamid     = steamid;
+        info.server_ip   = server_ip;
+        info.server_port = server_port;
+    }
+
+    std::size_t size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return entries.size();
+    }
+};
@@ -2,289 +2,832 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
 
+#pragma once
+
 // Note: Boost has a deprecation message telling us to use BOOST_BIND_GLOBAL_PLACEHOLDERS, but we don't use the global placeholders, so this is not a problem for us.
 // This actually seems to be caused by a faulty include made by boost itself.
-#include <boost/asio/connect.hpp>
-#include <boost/asio/deadline_timer.hpp>
-#include <boost/asio/ip/tcp.hpp>
-#ifdef __linux__
-#include <boost/asio/local/stream_protocol.hpp>
-#endif
+#include "clock.hpp"
+#include "handoff.hpp"
+#include "runtime.hpp"
+#include "sessionstream.hpp"
+#include "sharedframe.hpp"
+#include "threadoptions.hpp"
+#include "transport.hpp"
+
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
 
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <functional>
 #include <future>
+#include <memory>
+#include <optional>
 #include <string>
-#include <thread>
+#include <string_view>
+#include <deque>
 #include <queue>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
-namespace beast     = boost::beast;         // from <boost/beast.hpp>
-namespace http      = beast::http;          // from <boost/beast/http.hpp>
-namespace websocket = beast::websocket;     // from <boost/beast/websocket.hpp>
-namespace net       = boost::asio;          // from <boost/asio.hpp>
-using tcp           = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
-#ifdef __linux__
-namespace local = boost::asio::local;
-#endif
+namespace beast     = boost::beast;     // from <boost/beast.hpp>
+namespace http      = beast::http;      // from <boost/beast/http.hpp>
+namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
 
 constexpr int RESTART_WAIT_TIME = 10;
 
-#ifdef __linux__
-#define NULLNEXUS_GETWS(code) \
-    if (isunix)               \
-    {                         \
-        unixws->code;         \
-    }                         \
-    else                      \
-    {                         \
-        tcpws->code;          \
-    }
-#define NULLNEXUS_VALIDWS (isunix ? (unixws && unixws->is_open()) : (tcpws && tcpws->is_open()))
-#else
-#define NULLNEXUS_GETWS(code) \
-    {                         \
-        tcpws->code;          \
-    }
-#define NULLNEXUS_VALIDWS (tcpws && tcpws->is_open())
-#endif
+// Memory management of the buffer incoming messages are read into
+struct ReadBufferOptions
+{
+    // Capacity reserved when the client is created
+    std::size_t initial_capacity = 4096;
+    // Largest message accepted, a bigger one fails the connection
+    std::size_t max_message_size = 1024 * 1024;
+    // Release capacity above initial_capacity once no message needed it for this long. Checked when a message arrives, zero disables shrinking.
+    std::chrono::seconds shrink_after_idle = std::chrono::seconds(30);
+    // Reserve max_message_size up front and never reallocate or shrink
+    bool static_buffer = false;
+};
+
+// Outgoing frame settings, see beast::websocket::stream::auto_fragment and write_buffer_bytes
+struct WriteOptions
+{
+    // Split messages into frames of write_buffer_bytes
+    bool auto_fragment = true;
+    // Size of the buffer used for masking outgoing frames, also the fragment size with auto_fragment. Raised to 8 if smaller, beast's minimum.
+    std::size_t write_buffer_bytes = 4096;
+};
+
+struct ClientOptions
+{
+    // Worker thread settings, only used when the client creates its own runtime
+    ThreadOptions thread;
+    ReadBufferOptions read_buffer;
+    WriteOptions write;
+    // Keep a second, idle connection that takes over at once when the active one fails
+    bool standby = false;
+    // Keep track of received input, so the connection can be detached and adopted by another client (see SessionHandoff)
+    bool handoff = false;
+};
 
+// Transport independent interface, used by code that picks the transport at runtime (e.g. NullNexus)
 class WebSocketClient
 {
+public:
+    virtual void start(bool async = false)                                               = 0;
+    virtual void stop()                                                                  = 0;
+    virtual bool sendMessage(std::string msg, bool sendIfOffline = false)                = 0;
+    // Send several messages with a single handoff to the IO thread, they are written back to back with as few system calls as possible.
+    // Returns true if all of them were sent (or queued with sendIfOffline).
+    virtual bool sendBatch(std::vector<std::string> batch, bool sendIfOffline = false) = 0;
+    // Same as sendMessage for a frame that may be queued on other clients as well, the payload is shared instead of copied
+    virtual bool sendFrame(SharedFrame frame, bool sendIfOffline = false) = 0;
+    // Send without waiting for the IO thread. The message is dropped if not connected by the time it gets there,
+    // unless a connection is being set up: then it goes out once that is, or is dropped if it fails.
+    virtual void postMessage(std::string msg) = 0;
+    // Run reached(true) on the IO thread once the server has read everything sent (or posted) before, i.e. the pong to a ping sent after it arrived.
+    // Without a connection, or once it is lost, the ping goes out after the next handshake (which announces the current state) instead.
+    // reached(false) only happens if the client is destroyed or detached before that.
+    virtual void fence(std::function<void(bool read)> reached) = 0;
+    // Run fn on the IO thread, in order with the messages handled there
+    virtual void post(std::function<void()> fn) = 0;
+    // Send a message whose content is produced piece by piece, each piece goes out as its own fragment.
+    // producer fills chunk with the next piece and returns false once that was the last one. It is called on the IO thread.
+    // done (optional) is called with the result on the IO thread.
+    virtual void sendStream(std::function<bool(std::string &chunk)> producer, std::function<void(bool)> done = nullptr) = 0;
+    virtual void setCustomHeaders(std::vector<std::pair<std::string, std::string>> headers) = 0;
+    // Called with every incoming message before the message callback, directly over the read buffer. Returning true consumes the message.
+    // The view is only valid during the call, which happens on the IO thread.
+    virtual void setRawHandler(std::function<bool(std::string_view message)> handler) = 0;
+    // Produce the custom headers right before each handshake instead, on the IO thread. Replaces setCustomHeaders.
+    virtual void setCustomHeaderSource(std::function<std::vector<std::pair<std::string, std::string>>()> source) = 0;
+    // Extra handshake headers that tell the server a connection is a standby (see ClientOptions::standby), so it doesn't count
+    // it as a session yet. activation produces the message written first when the standby is promoted, on the IO thread.
+    virtual void setStandbyActivation(std::vector<std::pair<std::string, std::string>> headers, std::function<std::string()> activation) = 0;
+    // Stop the client and take its live connection out, for a client of the same transport to adopt. Null if not supported or possible right now.
+    virtual std::optional<SessionHandoff> detach()
+    {
+        return std::nullopt;
+    }
+
+    virtual ~WebSocketClient() = default;
+};
+
+// Websocket client running on top of a transport (see transport.hpp), with timers driven by Clock (see clock.hpp).
+// All socket operations are resolved at compile time, so there is no per-operation dispatch.
+// Runs on a runtime (see runtime.hpp) that can be shared with other clients.
+template <typename Transport, typename Clock = SteadyClock> class BasicWebSocketClient : public WebSocketClient
+{
+    using socket_type = typename Transport::socket_type;
+    using strand_type = net::strand<net::io_context::executor_type>;
+    using stream_type = websocket::stream<SessionStream<socket_type>>;
+
+    // Timer on the runtime's wheel. The generation identifies the latest arming, a callback that already
+    // left the wheel when the timer was cancelled or re-armed sees a newer one and does nothing.
+    struct ClientTimer
+    {
+        typename TimerWheel<Clock>::Timer timer;
+        std::size_t generation = 0;
+
+        ClientTimer(TimerWheel<Clock> &wheel) : timer(wheel)
+        {
+        }
+    };
+
     // Settings
-    std::string host, port, endpoint;
-    bool isunix;
+    Transport transport;
+    std::string endpoint;
     std::vector<std::pair<std::string, std::string>> custom_connect_headers;
+    std::function<std::vector<std::pair<std::string, std::string>>()> custom_header_source;
+    std::vector<std::pair<std::string, std::string>> standby_headers;
+    std::function<std::string()> standby_activation;
+    ClientOptions options;
     // Message callback
     std::function<void(std::string)> callback;
+    std::function<bool(std::string_view)> raw_handler;
 
     // ASIO
-    net::io_context ioc;
-    std::optional<net::executor_work_guard<decltype(ioc.get_executor())>> work;
-    std::optional<websocket::stream<tcp::socket>> tcpws;
-#ifdef __linux__
-    std::optional<websocket::stream<local::stream_protocol::socket>> unixws;
-#endif
-    beast::flat_buffer buf;
+    std::shared_ptr<BasicRuntime<Clock>> runtime;
+    // Everything this client does runs on its strand
+    strand_type strand;
+    // Streams and buffers live on the heap, so a standby can take over while its read is pending
+    std::unique_ptr<stream_type> ws;
+    std::unique_ptr<beast::flat_buffer> buf;
+    // Last time a message needed more than the initial buffer capacity
+    typename Clock::time_point last_large_message;
 
     // Delayed start (after failed connect)
-    net::deadline_timer start_delay_timer = net::deadline_timer(ioc);
-    // Message list with delivery when connected
-    net::deadline_timer message_queue_timer = net::deadline_timer(ioc);
-    std::queue<std::string> messages;
+    ClientTimer start_delay_timer{ runtime->timers() };
+    // Outgoing message, either owned or shared with other clients
+    struct QueuedMessage
+    {
+        std::string owned;
+        SharedFrame shared;
+        // Only queued behind a stream, must not be sent on another connection (sendIfOffline=false)
+        bool online_only = false;
 
-    // Worker thread
-    std::optional<std::thread> worker;
+        net::const_buffer buffer() const
+        {
+            return shared ? shared.buffer() : net::buffer(owned);
+        }
+        std::string release()
+        {
+            return shared ? std::string(shared.view()) : std::move(owned);
+        }
+    };
+    // Message list with delivery when connected. Flushed when the connection comes up and when a stream finishes, never polled.
+    std::deque<QueuedMessage> messages;
+
+    // Messages sent fragment by fragment, the front one is being written.
+    // Other messages have to wait until it is done, the websocket protocol does not allow interleaving them.
+    struct OutgoingStream
+    {
+        std::function<bool(std::string &)> producer;
+        std::function<void(bool)> done;
+        // Connection the first fragment was written on
+        std::optional<std::size_t> connection;
+    };
+    std::queue<OutgoingStream> streams;
+    // Waiting for the pong to the ping with their id, see fence(). Id 0 until pinged on the current connection, those come last.
+    std::deque<std::pair<std::uint64_t, std::function<void(bool)>>> fences;
+    std::uint64_t fences_sent = 0;
+    // Identifies the active websocket, every new websocket gets a new id
+    std::size_t connection_id = 0;
+    std::size_t connections_made = 0;
+
+    // Hot standby: handshaken connection that only answers pings until it gets promoted.
+    // Connects through standby_transport/standby_endpoint if set, like the active one otherwise.
+    std::optional<Transport> standby_transport;
+    std::optional<std::string> standby_endpoint;
+    std::unique_ptr<stream_type> standby;
+    std::unique_ptr<beast::flat_buffer> standby_buf;
+    std::size_t standby_id = 0;
+    bool standby_ready = false;
+    ClientTimer standby_timer{ runtime->timers() };
+
+    // Completion handlers that have yet to run, they refer to this client so the destructor waits for them
+    std::size_t outstanding = 0;
+    std::promise<void> *drained = nullptr;
 
     bool is_running = false;
+    // A connection attempt (connect and handshake) of the active websocket is in progress
+    bool connecting = false;
 
-    void log(std::string msg)
+    void log([[maybe_unused]] std::string msg)
     {
         // std::cout << msg << std::endl;
     }
 
+    bool isValid()
+    {
+        return ws && ws->is_open();
+    }
+
+    static socket_type &socketOf(stream_type &stream)
+    {
+        return stream.next_layer().next_layer();
+    }
+
     void handle_handler_error(const boost::system::error_code &ec)
     {
-        if (ec == net::error::basic_errors::operation_aborted)
+        // Whatever the server read on this connection, there is no pong to wait for anymore. The next connection pings again.
+        resetFences();
+        dropOnlineOnlyMessages();
+        // Stopped on purpose
+        if (ec == net::error::basic_errors::operation_aborted || !is_running)
             return;
         log(ec.message() + " " + std::to_string(ec.value()));
+        if (promoteStandby())
+            return;
         scheduleDelayedStart();
     }
 
-    // Function to run the internal ASIO loop
-    void runIO()
+    // Wrap a completion handler so it runs on the strand, whatever thread the operation completes on.
+    // The handler counts as outstanding until it ran. Must be called on the strand.
+    template <typename Handler> auto onStrand(Handler handler)
     {
-        ioc.run();
-        log("IOC exited");
+        outstanding++;
+        return net::bind_executor(strand, [this, handler](auto &&...args) mutable {
+            net::dispatch(strand, [this, handler, args = std::make_tuple(std::decay_t<decltype(args)>(args)...)]() mutable {
+                std::apply(handler, args);
+                if (--outstanding == 0 && drained)
+                    drained->set_value();
+            });
+        });
+    }
+
+    // Run fn on the strand after delay, replacing whatever the timer was armed with before
+    template <typename Duration> void armTimer(ClientTimer &timer, Duration delay, std::function<void()> fn)
+    {
+        cancelTimer(timer);
+        std::size_t generation = timer.generation;
+        timer.timer.schedule(delay, onStrand([&timer, generation, fn]() {
+            if (timer.generation == generation)
+                fn();
+        }));
+    }
+
+    void cancelTimer(ClientTimer &timer)
+    {
+        timer.generation++;
+        // Removed from the wheel, the callback will never run
+        if (timer.timer.cancel() && --outstanding == 0 && drained)
+            drained->set_value();
     }
 
     // Function gets called whenever a message or error is sent
-    void handler_onread(const boost::system::error_code &ec, std::size_t)
+    void handler_onread(const boost::system::error_code &ec, std::size_t, std::size_t id)
     {
+        if (id != connection_id)
+        {
+            handler_onstandbyread(ec, id);
+            return;
+        }
         if (ec)
         {
             // Let someone else handle this error
             handle_handler_error(ec);
             return;
         }
-        // Send message to callback
-        callback(beast::buffers_to_string(buf.data()));
-        buf.clear();
+        auto now = Clock::now();
+        if (buf->size() > options.read_buffer.initial_capacity)
+            last_large_message = now;
+        ws->next_layer().messageHandled();
+        // Send message to callback, unless the raw handler took it without any copy
+        auto data = buf->cdata();
+        if (!raw_handler || !raw_handler(std::string_view(static_cast<const char *>(data.data()), data.size())))
+            callback(beast::buffers_to_string(data));
+        buf->clear();
+        shrinkReadBuffer(now);
         // we stop reading after this call. We need to restart the handler.
         startAsyncRead();
     }
 
-    void handler_ontcpconnect(const boost::system::error_code &ec, std::promise<void> *ret)
+    void handler_onconnect(const boost::system::error_code &ec, std::promise<void> *ret, std::size_t id)
     {
+        // Replaced by a promoted standby in the meantime
+        if (id != connection_id)
+        {
+            if (ret)
+                ret->set_value();
+            return;
+        }
         if (ec)
         {
             log("Connection to server failed!");
+            connecting = false;
+            dropOnlineOnlyMessages();
             // Something is waiting for the first connection attempt to finish
             if (ret)
                 ret->set_value();
-            if (ec == net::error::basic_errors::operation_aborted)
+            if (ec == net::error::basic_errors::operation_aborted || !is_running)
                 return;
             scheduleDelayedStart();
             return;
         }
+        // Stopped after the connection was made but before we got here, nothing left to cancel the handshake
+        if (!is_running)
+        {
+            connecting = false;
+            if (ret)
+                ret->set_value();
+            transport.cancel(socketOf(*ws));
+            return;
+        }
         doWebsocketSetup(ret);
     }
 
+    // Give back memory a single large message made the buffer grow to
+    void shrinkReadBuffer(typename Clock::time_point now)
+    {
+        auto &read_options = options.read_buffer;
+        if (read_options.static_buffer || read_options.shrink_after_idle.count() == 0)
+            return;
+        if (buf->capacity() <= read_options.initial_capacity || now - last_large_message < read_options.shrink_after_idle)
+            return;
+        buf->shrink_to_fit();
+        buf->reserve(read_options.initial_capacity);
+    }
+
     // Start async reading from ASIO websocket
     void startAsyncRead()
     {
-        NULLNEXUS_GETWS(async_read(buf, beast::bind_front_handler(&WebSocketClient::handler_onread, this)))
+        ws->async_read(*buf, onStrand(std::bind(&BasicWebSocketClient::handler_onread, this, std::placeholders::_1, std::placeholders::_2, connection_id)));
     }
 
     void doWebsocketSetup(std::promise<void> *ret)
     {
-        try
-        {
-            // Set a decorator to change the User-Agent of the handshake
-            NULLNEXUS_GETWS(set_option(websocket::stream_base::decorator([&](websocket::request_type &req) {
-                for (auto &entry : custom_connect_headers)
-                {
-                    req.set(entry.first, entry.second);
-                }
-                req.set(http::field::user_agent, std::string(BOOST_BEAST_VERSION_STRING) + " websocket-client-coro");
-            })));
-            // Perform the websocket handshake
-            NULLNEXUS_GETWS(handshake(host, endpoint))
+        // Perform the websocket handshake, without blocking the IO thread while waiting for the server
+        ws->async_handshake(transport.handshakeHost(), endpoint, onStrand(std::bind(&BasicWebSocketClient::handler_onhandshake, this, std::placeholders::_1, ret, connection_id)));
+    }
 
-            log("CO: Connected to the server.");
-            // Something is waiting for the first connection attempt to finish
+    void handler_onhandshake(const boost::system::error_code &ec, std::promise<void> *ret, std::size_t id)
+    {
+        // Replaced by a promoted standby in the meantime
+        if (id != connection_id)
+        {
             if (ret)
                 ret->set_value();
-
-            startAsyncRead();
-            // Send cached messages
-            trySendMessageQueue();
+            return;
         }
-        catch (...)
+        connecting = false;
+        if (ec)
         {
             // Some error. Trying again later.
             log("CO: Websocket setup failed!");
+            // Posted while connecting, the next handshake is built from the current state anyway
+            dropOnlineOnlyMessages();
             // Something is waiting for the first connection attempt to finish
             if (ret)
                 ret->set_value();
-            scheduleDelayedStart();
+            if (ec != net::error::basic_errors::operation_aborted && is_running)
+                scheduleDelayedStart();
+            return;
         }
+
+        log("CO: Connected to the server.");
+        // Something is waiting for the first connection attempt to finish
+        if (ret)
+            ret->set_value();
+
+        startAsyncRead();
+        // Send cached messages, including what was posted during the handshake (its headers were built before that)
+        trySendMessageQueue();
+        pingFences();
+        ensureStandby();
     }
 
-    // Called by internalStart to run the actual connection code
-    void doConnectionAttempt(std::promise<void> *ret = nullptr)
+    // New websocket with our settings applied
+    std::unique_ptr<stream_type> makeStream(bool is_standby = false)
     {
-        try
-        {
-            tcp::resolver resolver{ ioc };
-
-#ifdef __linux__
-            if (isunix)
+        std::unique_ptr<stream_type> stream;
+        // Sockets that support it run on the strand, so their internal handlers are serialized with ours
+        if constexpr (std::is_constructible_v<socket_type, strand_type>)
+            stream = std::make_unique<stream_type>(strand);
+        else
+            stream = std::make_unique<stream_type>(runtime->context());
+        stream->read_message_max(options.read_buffer.max_message_size);
+        stream->auto_fragment(options.write.auto_fragment);
+        stream->write_buffer_bytes(writeBufferBytes());
+        stream->next_layer().setTracking(options.handoff);
+        // Bounds the opening and closing handshakes, so an unresponsive server can't stall us forever.
+        // Beast times them on the wall clock, with any other Clock (e.g. SimulatedClock) whoever drives it is in charge of the deadlines.
+        if constexpr (std::is_same_v<Clock, SteadyClock>)
+            stream->set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+        else
+            stream->set_option(websocket::stream_base::timeout{ websocket::stream_base::none(), websocket::stream_base::none(), false });
+        stream->control_callback([this](websocket::frame_type kind, beast::string_view payload) {
+            if (kind == websocket::frame_type::pong)
+                onPong(std::string_view(payload.data(), payload.size()));
+        });
+        // Set a decorator to change the User-Agent of the handshake
+        stream->set_option(websocket::stream_base::decorator([this, is_standby](websocket::request_type &req) {
+            for (auto &entry : custom_header_source ? custom_header_source() : custom_connect_headers)
             {
-                local::stream_protocol::endpoint ep(host);
-
-                // Create a new websocket, old one can't be used anymore after a .close() call
-                unixws.emplace(ioc);
-
-                // Connect to the websocket
-                unixws->next_layer().connect(ep);
-                doWebsocketSetup(ret);
+                req.set(entry.first, entry.second);
             }
-            else
-            {
-#endif
-                // Look up the domain name
-                auto const results = resolver.resolve(host, port);
+            if (is_standby)
+                for (auto &entry : standby_headers)
+                    req.set(entry.first, entry.second);
+            req.set(http::field::user_agent, std::string(BOOST_BEAST_VERSION_STRING) + " websocket-client-coro");
+        }));
+        return stream;
+    }
+
+    // Called by internalStart to run the actual connection code
+    void doConnectionAttempt(std::promise<void> *ret = nullptr)
+    {
+        // Create a new websocket, old one can't be used anymore after a .close() call
+        ws            = makeStream();
+        connection_id = ++connections_made;
+        connecting    = true;
 
-                // Create a new websocket, old one can't be used anymore after a .close() call
-                tcpws.emplace(ioc);
+        // Errors (including failed name resolution) are reported to handler_onconnect
+        transport.asyncConnect(socketOf(*ws), onStrand(std::bind(&BasicWebSocketClient::handler_onconnect, this, std::placeholders::_1, ret, connection_id)));
+    }
 
-                net::async_connect(tcpws->next_layer(), results.begin(), results.end(), std::bind(&WebSocketClient::handler_ontcpconnect, this, std::placeholders::_1, ret));
-#ifdef __linux__
-            }
-#endif
+    /* Functions for the hot standby */
+    Transport &standbyTransport()
+    {
+        return standby_transport ? *standby_transport : transport;
+    }
+    // Build a standby if enabled and there is none yet, only while connected so a down server isn't hit twice
+    void ensureStandby()
+    {
+        if (!is_running || !(options.standby || standby_transport) || standby || !isValid())
+            return;
+        standby       = makeStream(true);
+        standby_id    = ++connections_made;
+        standby_ready = false;
+        standby_buf->reserve(options.read_buffer.static_buffer ? options.read_buffer.max_message_size : options.read_buffer.initial_capacity);
+        standbyTransport().asyncConnect(socketOf(*standby), onStrand(std::bind(&BasicWebSocketClient::handler_standbyconnect, this, std::placeholders::_1, standby_id)));
+    }
+    void failStandby(const boost::system::error_code &ec)
+    {
+        standby.reset();
+        standby_ready = false;
+        if (is_running && ec != net::error::basic_errors::operation_aborted)
+            armTimer(standby_timer, std::chrono::seconds(RESTART_WAIT_TIME), std::bind(&BasicWebSocketClient::ensureStandby, this));
+    }
+    void handler_standbyconnect(const boost::system::error_code &ec, std::size_t id)
+    {
+        if (!standby || id != standby_id)
+            return;
+        if (ec)
+        {
+            failStandby(ec);
+            return;
+        }
+        standby->async_handshake(standbyTransport().handshakeHost(), standby_endpoint ? *standby_endpoint : endpoint, onStrand(std::bind(&BasicWebSocketClient::handler_standbyhandshake, this, std::placeholders::_1, id)));
+    }
+    void handler_standbyhandshake(const boost::system::error_code &ec, std::size_t id)
+    {
+        if (!standby || id != standby_id)
+            return;
+        if (ec)
+        {
+            failStandby(ec);
+            return;
         }
-        catch (...)
+        standby_ready = true;
+        startStandbyRead();
+        // The active connection failed while we were connecting, no need to wait for the restart
+        if (is_running && !isValid())
         {
-            // Some error. Trying again later.
-            log("CO: Connection to server failed!");
-            // Something is waiting for the first connection attempt to finish
-            if (ret)
-                ret->set_value();
-            scheduleDelayedStart();
+            cancelTimer(start_delay_timer);
+            promoteStandby();
         }
     }
-
-    /* Functions for handling the sending of messages */
-    void handle_timerMessageQueue(const boost::system::error_code &ec)
+    void startStandbyRead()
     {
+        standby->async_read(*standby_buf, onStrand(std::bind(&BasicWebSocketClient::handler_onread, this, std::placeholders::_1, std::placeholders::_2, standby_id)));
+    }
+    // The standby only reads to answer pings and notice failures, whatever it receives is also sent on the active connection
+    void handler_onstandbyread(const boost::system::error_code &ec, std::size_t id)
+    {
+        // Belongs to a connection that is gone
+        if (!standby || id != standby_id)
+            return;
         if (ec)
+        {
+            failStandby(ec);
             return;
+        }
+        standby->next_layer().messageHandled();
+        standby_buf->clear();
+        startStandbyRead();
+    }
+    // Make the standby the active connection. Its read is already pending, so it delivers messages right away.
+    bool promoteStandby()
+    {
+        if (!standby || !standby_ready)
+            return false;
+        ws.swap(standby);
+        buf.swap(standby_buf);
+        connection_id = standby_id;
+        connecting    = false;
+        // The old connection may still be connecting
+        transport.cancel(socketOf(*standby));
+        standby.reset();
+        standby_buf->clear();
+        standby_ready = false;
+        log("CO: Standby promoted.");
+        // Tell the server this is the live session now, before anything else goes out
+        if (standby_activation)
+        {
+            std::string activation = standby_activation();
+            boost::system::error_code ec;
+            ws->write(net::buffer(activation), ec);
+            if (ec)
+            {
+                failConnection(ec);
+                return true;
+            }
+        }
         trySendMessageQueue();
+        pingFences();
+        // Rebuild the standby in the background
+        ensureStandby();
+        return true;
     }
+    void closeStandby()
+    {
+        if (!standby)
+            return;
+        if (standby_ready)
+            standby->async_close(websocket::close_code::normal, onStrand([](const boost::system::error_code &) {}));
+        else
+            standbyTransport().cancel(socketOf(*standby));
+        standby_ready = false;
+    }
+    /* ~Functions for the hot standby~ */
+
+    /* Functions for handling the sending of messages */
     void trySendMessageQueue()
     {
-        if (!NULLNEXUS_VALIDWS)
+        if (!isValid() || !streams.empty())
             return;
 
-        while (messages.size())
+        // Queued messages go out in batches that fit the cork, so nothing is sent before the batch is flushed.
+        // They only leave the queue once the flush succeeded, after a failure the reconnect sends them again.
+        auto &session = ws->next_layer();
+        while (!messages.empty())
         {
-            try
+            std::size_t count = 0, size = 0;
+            boost::system::error_code ec, flush_ec;
+            session.cork();
+            while (count < messages.size() && !ec)
             {
-                if (!NULLNEXUS_VALIDWS)
-                    throw std::exception();
-                NULLNEXUS_GETWS(write(net::buffer(messages.front())));
-                messages.pop();
+                std::size_t next = wireSize(messages[count].buffer().size());
+                // A single large message bypasses the cork and is written on its own
+                if (count && size + next > stream_type::next_layer_type::CORK_LIMIT)
+                    break;
+                ws->write(messages[count].buffer(), ec);
+                size += next;
+                count++;
             }
-            catch (...)
+            session.uncork(flush_ec);
+            if (ec || flush_ec)
             {
-                message_queue_timer.cancel();
-                message_queue_timer.expires_from_now(boost::posix_time::seconds(1));
-                message_queue_timer.async_wait(std::bind(&WebSocketClient::handle_timerMessageQueue, this, std::placeholders::_1));
+                failConnection(ec ? ec : flush_ec);
                 return;
             }
+            messages.erase(messages.begin(), messages.begin() + count);
         }
     }
-    void onImmediateMessageSend(std::string msg, std::promise<bool> &ret)
+    // The connection they were meant for is gone
+    void dropOnlineOnlyMessages()
     {
-        try
+        messages.erase(std::remove_if(messages.begin(), messages.end(), [](const QueuedMessage &msg) { return msg.online_only; }), messages.end());
+    }
+    std::size_t writeBufferBytes() const
+    {
+        return std::max<std::size_t>(options.write.write_buffer_bytes, 8);
+    }
+    // Upper bound of the bytes the websocket writes for a message of size bytes
+    std::size_t wireSize(std::size_t size) const
+    {
+        // Largest client frame header: 2 bytes, 8 byte length and the mask
+        constexpr std::size_t HEADER = 14;
+        std::size_t frames           = options.write.auto_fragment ? size / writeBufferBytes() + 1 : 1;
+        return size + frames * HEADER;
+    }
+    // A write failed. The pending read may take a while to notice, so drop the connection and reconnect right away.
+    void failConnection(const boost::system::error_code &ec)
+    {
+        transport.cancel(socketOf(*ws));
+        // The aborted read belongs to the old connection and is ignored
+        connection_id = ++connections_made;
+        handle_handler_error(ec);
+    }
+    bool writeBatch(std::vector<std::string> &batch)
+    {
+        boost::system::error_code ec;
+        ws->next_layer().cork();
+        for (auto &msg : batch)
+        {
+            ws->write(net::buffer(msg), ec);
+            if (ec)
+                break;
+        }
+        boost::system::error_code flush_ec;
+        ws->next_layer().uncork(flush_ec);
+        if (ec || flush_ec)
         {
-            if (!NULLNEXUS_VALIDWS)
+            failConnection(ec ? ec : flush_ec);
+            return false;
+        }
+        return true;
+    }
+    // ret is null when the batch may be queued while offline
+    void onBatchSend(std::vector<std::string> batch, std::promise<bool> *ret)
+    {
+        // Queued for later, or behind a fragmented message in progress. Without sendIfOffline these don't survive a reconnect.
+        if (!ret || (isValid() && !streams.empty()))
+        {
+            for (auto &msg : batch)
+                messages.push_back(QueuedMessage{ std::move(msg), SharedFrame(), ret != nullptr });
+            if (ret)
+                ret->set_value(true);
+            else
+                trySendMessageQueue();
+            return;
+        }
+        ret->set_value(isValid() && writeBatch(batch));
+    }
+    void onImmediateMessageSend(QueuedMessage msg, std::promise<bool> &ret)
+    {
+        if (!isValid())
+        {
+            ret.set_value(false);
+            return;
+        }
+        // A fragmented message is in progress, queue behind it
+        if (!streams.empty())
+        {
+            msg.online_only = true;
+            messages.push_back(std::move(msg));
+            ret.set_value(true);
+            return;
+        }
+        boost::system::error_code ec;
+        ws->write(msg.buffer(), ec);
+        ret.set_value(!ec);
+        if (ec)
+            failConnection(ec);
+    }
+    void onPostedMessageSend(QueuedMessage msg)
+    {
+        // Goes out once the connection being set up is, its handshake may already have been built from older state
+        if (!isValid())
+        {
+            if (connecting)
             {
-                ret.set_value(false);
-                return;
+                msg.online_only = true;
+                messages.push_back(std::move(msg));
             }
-            NULLNEXUS_GETWS(write(net::buffer(msg)));
-            ret.set_value(true);
+            return;
         }
-        catch (...)
+        // A fragmented message is in progress, queue behind it
+        if (!streams.empty())
         {
-            ret.set_value(false);
+            msg.online_only = true;
+            messages.push_back(std::move(msg));
             return;
         }
+        boost::system::error_code ec;
+        ws->write(msg.buffer(), ec);
+        if (ec)
+            failConnection(ec);
+    }
+    void onFence(std::function<void(bool)> reached)
+    {
+        fences.push_back({ 0, std::move(reached) });
+        if (isValid())
+            pingFences();
     }
-    void onAsyncMessageSend(std::string msg)
+    // One ping covers all fences that weren't pinged on the current connection yet
+    void pingFences()
+    {
+        if (fences.empty() || fences.back().first)
+            return;
+        auto id = ++fences_sent;
+        for (auto it = fences.rbegin(); it != fences.rend() && !it->first; ++it)
+            it->first = id;
+        boost::system::error_code ec;
+        ws->ping(websocket::ping_data(std::to_string(id).c_str()), ec);
+        if (ec)
+            failConnection(ec);
+    }
+    // Pongs come back in order, everything up to the one answered has been read by the server
+    void onPong(std::string_view payload)
+    {
+        std::uint64_t id = 0;
+        if (std::from_chars(payload.data(), payload.data() + payload.size(), id).ec != std::errc())
+            return;
+        while (!fences.empty() && fences.front().first && fences.front().first <= id)
+        {
+            auto reached = std::move(fences.front().second);
+            fences.pop_front();
+            reached(true);
+        }
+    }
+    void resetFences()
+    {
+        for (auto &fence : fences)
+            fence.first = 0;
+    }
+    void releaseFences()
+    {
+        while (!fences.empty())
+        {
+            auto reached = std::move(fences.front().second);
+            fences.pop_front();
+            reached(false);
+        }
+    }
+    void onAsyncMessageSend(QueuedMessage msg)
     {
         // Push into a queue
-        messages.push(msg);
+        messages.push_back(std::move(msg));
         // Try to send said queue
         trySendMessageQueue();
     }
-    /* ~Functions for handling the sending of messages~ */
-
-    // React to the timer being activated
-    void handler_startDelayTimer(const boost::system::error_code &ec)
+    // Hand msg to the strand, see sendMessage
+    bool sendQueued(QueuedMessage msg, bool sendIfOffline)
     {
+        if (sendIfOffline)
+        {
+            // Let the worker thread handle this safely
+            net::post(strand, [this, msg = std::move(msg)]() mutable { onAsyncMessageSend(std::move(msg)); });
+            return true;
+        }
+        else
+        {
+            std::promise<bool> ret;
+            auto future = ret.get_future();
+            // Let the worker thread handle this safely
+            net::post(strand, [this, msg = std::move(msg), &ret]() mutable { onImmediateMessageSend(std::move(msg), ret); });
+            future.wait();
+            return future.get();
+        }
+    }
+    void onStreamSend(OutgoingStream stream)
+    {
+        streams.push(stream);
+        if (streams.size() == 1)
+            continueStream();
+    }
+    // Write the next fragment of the current stream
+    void continueStream()
+    {
+        auto &stream = streams.front();
+        // A half written message can't be continued on a new connection
+        if (!isValid() || (stream.connection && *stream.connection != connection_id))
+        {
+            finishStream(false);
+            return;
+        }
+        stream.connection = connection_id;
+
+        std::string chunk;
+        bool more = stream.producer(chunk);
+        boost::system::error_code ec;
+        ws->write_some(!more, net::buffer(chunk), ec);
+        // The failed write closes the websocket, the pending read only sees operation_aborted then
         if (ec)
+            failConnection(ec);
+        if (ec || !more)
+        {
+            finishStream(!ec);
             return;
-        doConnectionAttempt();
+        }
+        // Let reads and timers run between fragments
+        net::post(strand, onStrand(std::bind(&BasicWebSocketClient::continueStream, this)));
+    }
+    void finishStream(bool success)
+    {
+        auto done = streams.front().done;
+        streams.pop();
+        if (done)
+            done(success);
+        if (!streams.empty())
+            net::post(strand, onStrand(std::bind(&BasicWebSocketClient::continueStream, this)));
+        else
+            // Send what queued up behind the stream
+            trySendMessageQueue();
     }
+    /* ~Functions for handling the sending of messages~ */
 
-    // Use the io_context+worker to sheudule a restart/start
+    // Use the timer wheel to sheudule a restart/start
     void scheduleDelayedStart()
     {
-        start_delay_timer.cancel();
-        start_delay_timer.expires_from_now(boost::posix_time::seconds(RESTART_WAIT_TIME));
-        start_delay_timer.async_wait(std::bind(&WebSocketClient::handler_startDelayTimer, this, std::placeholders::_1));
+        armTimer(start_delay_timer, std::chrono::seconds(RESTART_WAIT_TIME), std::bind(&BasicWebSocketClient::doConnectionAttempt, this, nullptr));
     }
     void internalStart(std::promise<void> *ret)
     {
@@ -305,97 +848,280 @@ class WebSocketClient
             return;
         }
         is_running = false;
-        start_delay_timer.cancel();
-        // Stop message queue from running while stopped
-        message_queue_timer.cancel();
-        if (tcpws)
-            tcpws->next_layer().cancel();
-        if (NULLNEXUS_VALIDWS)
+        connecting = false;
+        cancelTimer(start_delay_timer);
+        cancelTimer(standby_timer);
+        closeStandby();
+        // Pinged again once started again
+        resetFences();
+        dropOnlineOnlyMessages();
+        if (!isValid())
+        {
+            // Abort a connection attempt in progress
+            if (ws)
+                transport.cancel(socketOf(*ws));
+            ret.set_value();
+            return;
+        }
+        // Closing asynchronously, a synchronous close would race the pending read. The pending read completes with an error once closed.
+        ws->async_close(websocket::close_code::normal, onStrand([&ret](const boost::system::error_code &) { ret.set_value(); }));
+    }
+
+    void internalDetach(std::promise<std::optional<SessionHandoff>> &ret)
+    {
+        if constexpr (!TransportSupportsHandoff<Transport>::value)
+            ret.set_value(std::nullopt);
+        else
+        {
+            // Without tracking the unhandled input is unknown, half sent streams can't be continued by someone else
+            if (!options.handoff || !is_running || !isValid() || !streams.empty())
+            {
+                ret.set_value(std::nullopt);
+                return;
+            }
+            SessionHandoff handoff;
+            handoff.pending_input = ws->next_layer().unhandledInput();
+            boost::system::error_code ec;
+            // Pending operations on the socket complete with operation_aborted, the connection stays open
+            handoff.fd = Transport::release(socketOf(*ws), ec);
+            if (ec)
+            {
+                ret.set_value(std::nullopt);
+                return;
+            }
+            is_running = false;
+            cancelTimer(start_delay_timer);
+            cancelTimer(standby_timer);
+            closeStandby();
+            // The new owner only gets the session from here on
+            releaseFences();
+            for (auto &msg : messages)
+                handoff.queued_messages.push_back(msg.release());
+            messages.clear();
+            // Whatever still completes for the old websocket is ignored
+            connection_id = ++connections_made;
+            ws.reset();
+            buf->clear();
+            ret.set_value(std::move(handoff));
+        }
+    }
+
+    void internalAdopt(SessionHandoff &handoff, std::promise<bool> &ret)
+    {
+        if constexpr (!TransportSupportsHandoff<Transport>::value)
+            ret.set_value(false);
+        else
         {
-            NULLNEXUS_GETWS(close(websocket::close_code::normal));
+            if (is_running)
+            {
+                ret.set_value(false);
+                return;
+            }
+            auto stream = makeStream();
+            boost::system::error_code ec;
+            Transport::adopt(socketOf(*stream), handoff.fd, ec);
+            if (ec)
+            {
+                ret.set_value(false);
+                return;
+            }
+            // The connection is upgraded already. Beast can only open a websocket through a handshake, so answer it locally, nothing is sent.
+            stream->next_layer().beginReplay(handoff.pending_input);
+            stream->handshake(transport.handshakeHost(), endpoint, ec);
+            stream->next_layer().endReplay();
+            if (ec)
+            {
+                // The descriptor stays with the caller
+                Transport::release(socketOf(*stream), ec);
+                ret.set_value(false);
+                return;
+            }
+            ws            = std::move(stream);
+            connection_id = ++connections_made;
+            is_running    = true;
+            // What was queued before the handoff goes first
+            for (auto it = handoff.queued_messages.rbegin(); it != handoff.queued_messages.rend(); ++it)
+                messages.push_front(QueuedMessage{ std::move(*it), SharedFrame() });
+            // Everything is ours now, nothing is left for the caller to close or send
+            handoff.fd = -1;
+            handoff.pending_input.clear();
+            handoff.queued_messages.clear();
+            ret.set_value(true);
+
+            startAsyncRead();
+            trySendMessageQueue();
+            pingFences();
+            ensureStandby();
         }
-        ret.set_value();
     }
 
-    void internalSetCustomHeaders(std::vector<std::pair<std::string, std::string>> headers, std::promise<void> &ret)
+    // Last step of destruction, waits until no handler refers to this client anymore
+    void internalShutdown(std::promise<void> &ret)
+    {
+        cancelTimer(start_delay_timer);
+        cancelTimer(standby_timer);
+        releaseFences();
+        if (ws)
+            transport.cancel(socketOf(*ws));
+        if (standby)
+            standbyTransport().cancel(socketOf(*standby));
+        if (outstanding == 0)
+            ret.set_value();
+        else
+            drained = &ret;
+    }
+
+    void internalSetCustomHeaders(std::vector<std::pair<std::string, std::string>> headers)
     {
         custom_connect_headers = headers;
-        ret.set_value();
+        custom_header_source   = nullptr;
+    }
+    void internalSetRawHandler(std::function<bool(std::string_view)> handler)
+    {
+        raw_handler = handler;
+    }
+    void internalSetCustomHeaderSource(std::function<std::vector<std::pair<std::string, std::string>>()> source)
+    {
+        custom_header_source = source;
+    }
+    void internalSetStandbyActivation(std::vector<std::pair<std::string, std::string>> headers, std::function<std::string()> activation)
+    {
+        standby_headers    = headers;
+        standby_activation = activation;
     }
 
 public:
-    void start(bool async = false)
+    void start(bool async = false) override
     {
         if (async)
             // Let boost deal with anything related to thread safety
-            net::post(ioc, std::bind(&WebSocketClient::internalStart, this, nullptr));
+            net::post(strand, std::bind(&BasicWebSocketClient::internalStart, this, nullptr));
         else
         {
             std::promise<void> ret;
             auto future = ret.get_future();
             // Let boost deal with anything related to thread safety
-            net::post(ioc, std::bind(&WebSocketClient::internalStart, this, &ret));
+            net::post(strand, std::bind(&BasicWebSocketClient::internalStart, this, &ret));
             future.wait();
         }
     }
-    void stop()
+    void stop() override
     {
         std::promise<void> ret;
         auto future = ret.get_future();
         // Let boost deal with anything related to thread safety
-        net::post(ioc, std::bind(&WebSocketClient::internalStop, this, std::ref(ret)));
+        net::post(strand, std::bind(&BasicWebSocketClient::internalStop, this, std::ref(ret)));
         future.wait();
     }
 
-    bool sendMessage(std::string msg, bool sendIfOffline = false)
+    bool sendMessage(std::string msg, bool sendIfOffline = false) override
+    {
+        return sendQueued(QueuedMessage{ std::move(msg), SharedFrame() }, sendIfOffline);
+    }
+    bool sendFrame(SharedFrame frame, bool sendIfOffline = false) override
+    {
+        return sendQueued(QueuedMessage{ std::string(), std::move(frame) }, sendIfOffline);
+    }
+    bool sendBatch(std::vector<std::string> batch, bool sendIfOffline = false) override
     {
         if (sendIfOffline)
         {
-            // Let the worker thread handle this safely
-            net::post(ioc, std::bind(&WebSocketClient::onAsyncMessageSend, this, msg));
+            net::post(strand, [this, batch = std::move(batch)]() mutable { onBatchSend(std::move(batch), nullptr); });
             return true;
         }
-        else
-        {
-            std::promise<bool> ret;
-            auto future = ret.get_future();
-            // Let the worker thread handle this safely
-            net::post(ioc, std::bind(&WebSocketClient::onImmediateMessageSend, this, msg, std::ref(ret)));
-            future.wait();
-            return future.get();
-        }
+        std::promise<bool> ret;
+        auto future = ret.get_future();
+        net::post(strand, [this, batch = std::move(batch), &ret]() mutable { onBatchSend(std::move(batch), &ret); });
+        return future.get();
     }
 
-    void setCustomHeaders(std::vector<std::pair<std::string, std::string>> headers)
+    void postMessage(std::string msg) override
     {
-        std::promise<void> ret;
+        // Let the worker thread handle this safely
+        net::post(strand, [this, msg = QueuedMessage{ std::move(msg), SharedFrame() }]() mutable { onPostedMessageSend(std::move(msg)); });
+    }
+
+    void fence(std::function<void(bool read)> reached) override
+    {
+        net::post(strand, std::bind(&BasicWebSocketClient::onFence, this, std::move(reached)));
+    }
+
+    void post(std::function<void()> fn) override
+    {
+        net::post(strand, std::move(fn));
+    }
+
+    void sendStream(std::function<bool(std::string &chunk)> producer, std::function<void(bool)> done = nullptr) override
+    {
+        // Let the worker thread handle this safely
+        net::post(strand, std::bind(&BasicWebSocketClient::onStreamSend, this, OutgoingStream{ producer, done, std::nullopt }));
+    }
+
+    // See WebSocketClient::detach, needs ClientOptions::handoff and a transport with release() and adopt() (see transport.hpp).
+    // Nothing is sent, the server doesn't notice. Fails while a stream is being sent.
+    std::optional<SessionHandoff> detach() override
+    {
+        std::promise<std::optional<SessionHandoff>> ret;
         auto future = ret.get_future();
-        net::post(ioc, std::bind(&WebSocketClient::internalSetCustomHeaders, this, headers, std::ref(ret)));
-        future.wait();
+        net::post(strand, std::bind(&BasicWebSocketClient::internalDetach, this, std::ref(ret)));
+        return future.get();
+    }
+
+    // Continue a detached session instead of connecting, replaces start(). Reconnects go to our own transport and endpoint if the connection fails later.
+    // On success the client takes the descriptor and the queued messages out of handoff. On failure handoff is left as it was,
+    // the caller still owns the descriptor and can retry or close it.
+    bool adopt(SessionHandoff &handoff)
+    {
+        std::promise<bool> ret;
+        auto future = ret.get_future();
+        net::post(strand, std::bind(&BasicWebSocketClient::internalAdopt, this, std::ref(handoff), std::ref(ret)));
+        return future.get();
     }
 
-    WebSocketClient(std::string host, std::string port, std::string endpoint, std::function<void(std::string)> callback) : host(host), port(port), endpoint(endpoint), callback(callback)
+    // Hot standby through another transport and/or endpoint (e.g. a second node behind the load balancer), implies ClientOptions::standby.
+    // Must be called before start().
+    void setStandbyTransport(Transport other, std::optional<std::string> other_endpoint = std::nullopt)
     {
-        isunix = false;
-        work.emplace(ioc.get_executor());
-        worker.emplace(std::bind(&WebSocketClient::runIO, this));
+        standby_transport = other;
+        standby_endpoint  = other_endpoint;
     }
-#ifdef __linux__
-    WebSocketClient(std::string unixsocket_addr, std::string endpoint, std::function<void(std::string)> callback) : host(unixsocket_addr), endpoint(endpoint), callback(callback)
+
+    void setRawHandler(std::function<bool(std::string_view message)> handler) override
     {
-        isunix = true;
-        work.emplace(ioc.get_executor());
-        worker.emplace(std::bind(&WebSocketClient::runIO, this));
+        net::post(strand, std::bind(&BasicWebSocketClient::internalSetRawHandler, this, handler));
     }
-#endif
 
-    ~WebSocketClient()
+    // Both take effect on the next handshake. Nothing to wait for, the handshake is started on the strand after them.
+    void setCustomHeaders(std::vector<std::pair<std::string, std::string>> headers) override
+    {
+        net::post(strand, std::bind(&BasicWebSocketClient::internalSetCustomHeaders, this, headers));
+    }
+    void setCustomHeaderSource(std::function<std::vector<std::pair<std::string, std::string>>()> source) override
+    {
+        net::post(strand, std::bind(&BasicWebSocketClient::internalSetCustomHeaderSource, this, source));
+    }
+    void setStandbyActivation(std::vector<std::pair<std::string, std::string>> headers, std::function<std::string()> activation) override
+    {
+        net::post(strand, std::bind(&BasicWebSocketClient::internalSetStandbyActivation, this, headers, activation));
+    }
+
+    // Without a runtime the client creates its own, with one thread using options.thread
+    BasicWebSocketClient(Transport transport, std::string endpoint, std::function<void(std::string)> callback, ClientOptions options = ClientOptions(), std::shared_ptr<BasicRuntime<Clock>> shared_runtime = nullptr) : transport(transport), endpoint(endpoint), options(options), callback(callback), runtime(shared_runtime ? shared_runtime : std::make_shared<BasicRuntime<Clock>>(1, options.thread)), strand(net::make_strand(runtime->context())), buf(std::make_unique<beast::flat_buffer>(options.read_buffer.max_message_size)), standby_buf(std::make_unique<beast::flat_buffer>(options.read_buffer.max_message_size))
+    {
+        buf->reserve(options.read_buffer.static_buffer ? options.read_buffer.max_message_size : options.read_buffer.initial_capacity);
+    }
+
+    ~BasicWebSocketClient()
     {
         stop();
-        work.reset();
-        worker->join();
+        std::promise<void> ret;
+        auto future = ret.get_future();
+        net::post(strand, std::bind(&BasicWebSocketClient::internalShutdown, this, std::ref(ret)));
+        future.wait();
     }
 };
 
-#undef NULLNEXUS_GETWS
-#undef NULLNEXUS_VALIDWS
+using TcpWebSocketClient = BasicWebSocketClient<TcpTransport>;
+#ifdef __linux__
+using UnixWebSocketClient = BasicWebSocketClient<UnixTransport>;
+#endif
@@ -0,0 +1,73 @@
+/* Any copyright is dedicated to the Public Domain.
+ * https://creativecommons.org/publicdomain/zero/1.0/ */
+
+#include "libnullnexus/shardedserver.hpp"
+
+#include <boost/asio/signal_set.hpp>
+
+#include <charconv>
+#include <iostream>
+
+#ifdef BOOST_NO_EXCEPTIONS
+// Required by boost when building with NULLNEXUS_NO_EXCEPTIONS
+namespace boost
+{
+void throw_exception(std::exception const &e)
+{
+    std::cerr << e.what() << std::endl;
+    std::abort();
+}
+void throw_exception(std::exception const &e, boost::source_location const &)
+{
+    throw_exception(e);
+}
+} // namespace boost
+#endif
+
+// Whole argument as a number, nothing else accepted
+template <typename T> static bool parseNumber(std::string_view text, T &value)
+{
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+static int usage()
+{
+    std::cerr << "Usage: nullnexus-server [address] [port] [shards]" << std::endl;
+    return 1;
+}
+
+// Usage: nullnexus-server [address] [port] [shards]
+int main(int argc, char **argv)
+{
+    std::string address = argc > 1 ? argv[1] : "0.0.0.0";
+    std::string port    = argc > 2 ? argv[2] : "3000";
+    std::uint16_t port_number;
+    unsigned int shards = 0;
+    if (!parseNumber(port, port_number) || (argc > 3 && !parseNumber(std::string_view(argv[3]), shards)))
+        return usage();
+
+    boost::system::error_code ec;
+    auto ip = net::ip::make_address(address, ec);
+    if (ec)
+    {
+        std::cerr << "Invalid address " << address << std::endl;
+        return usage();
+    }
+
+    // One shard per core unless told otherwise
+    ShardedNullNexusServer server(shards);
+    if (!server.listen(tcp::endpoint(ip, port_number), ec))
+    {
+        std::cerr << "Can't listen on " << address << ":" << port << ": " << ec.message() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Listening on " << server.localEndpoint() << " with " << server.shardCount() << " shards" << std::endl;
+
+    // The shards run on their own threads, this one only waits for the signal
+    net::io_context ioc;
+    net::signal_set signals(ioc, SIGINT, SIGTERM);
+    signals.async_wait([&](const boost::system::error_code &, int) { server.stop(); });
+    ioc.run();
+}
@@ -0,0 +1,493 @@
+/* Any copyright is dedicated to the Public Domain.
+ * https://creativecommons.org/publicdomain/zero/1.0/ */
+
+#include "libnullnexus/nullnexus.hpp"
+#include "libnullnexus/simulation.hpp"
+#include "libnullnexus/timerwheel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef BOOST_NO_EXCEPTIONS
+// Required by boost when building with NULLNEXUS_NO_EXCEPTIONS
+namespace boost
+{
+void throw_exception(std::exception const &e)
+{
+    std::cerr << e.what() << std::endl;
+    std::abort();
+}
+void throw_exception(std::exception const &e, boost::source_location const &)
+{
+    throw_exception(e);
+}
+} // namespace boost
+#endif
+
+// Refuse, connect, drop and reconnect scenarios on SimulatedNetwork, and the timer wheel underneath, in virtual time.
+// Usage: nullnexus-simulation [runs]. Prints the wall time all runs took, returns non-zero if a check failed.
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                             \
+    do                                                                                               \
+    {                                                                                                \
+        if (!(condition))                                                                            \
+        {                                                                                            \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            failures++;                                                                              \
+        }                                                                                            \
+    } while (false)
+
+// Wait for something the IO threads do, false if it didn't happen within timeout (wall time)
+static bool waitFor(std::function<bool()> condition, std::chrono::milliseconds timeout = std::chrono::seconds(5))
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!condition())
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// Websocket server on its own thread, accepting everything the network lets through
+class Server
+{
+    net::io_context ioc;
+    net::executor_work_guard<net::io_context::executor_type> work;
+    std::thread thread;
+
+    struct Peer
+    {
+        std::shared_ptr<beast::test::stream> end;
+        websocket::stream<beast::test::stream &> ws;
+        beast::flat_buffer buf;
+
+        explicit Peer(std::shared_ptr<beast::test::stream> end) : end(end), ws(*end)
+        {
+        }
+    };
+    // Peers that didn't get a handshake answer (yet), kept open until the end
+    std::vector<std::shared_ptr<beast::test::stream>> silent;
+
+    void read(std::shared_ptr<Peer> peer)
+    {
+        peer->ws.async_read(peer->buf, [this, peer](const boost::system::error_code &ec, std::size_t) {
+            if (ec)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                received.push_back(beast::buffers_to_string(peer->buf.data()));
+            }
+            peer->buf.clear();
+            read(peer);
+        });
+    }
+
+    void accept(std::shared_ptr<beast::test::stream> end)
+    {
+        if (!answer)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            silent.push_back(end);
+            return;
+        }
+        answerHandshake(end);
+    }
+
+    void answerHandshake(std::shared_ptr<beast::test::stream> end)
+    {
+        auto peer = std::make_shared<Peer>(end);
+        peer->ws.async_accept([this, peer](const boost::system::error_code &ec) {
+            if (ec)
+                return;
+            accepted++;
+            read(peer);
+        });
+    }
+
+public:
+    SimulatedNetwork network;
+    std::atomic<int> accepted{ 0 };
+    // Answer websocket handshakes, a silent server takes the connection and never says anything
+    std::atomic<bool> answer{ true };
+    std::mutex mutex;
+    std::vector<std::string> received;
+
+    Server() : work(ioc.get_executor()), network(ioc, std::bind(&Server::accept, this, std::placeholders::_1))
+    {
+        SimulatedClock::reset();
+        thread = std::thread([this]() { ioc.run(); });
+    }
+
+    ~Server()
+    {
+        work.reset();
+        ioc.stop();
+        thread.join();
+    }
+
+    // Connections waiting for a handshake answer
+    std::size_t heldCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return silent.size();
+    }
+
+    // Answer the handshakes held so far
+    void answerHeld()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &end : silent)
+            net::post(ioc, std::bind(&Server::answerHandshake, this, end));
+        silent.clear();
+    }
+
+    std::size_t receivedCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return received.size();
+    }
+};
+
+static const auto RESTART_DELAY = std::chrono::seconds(RESTART_WAIT_TIME);
+// Smallest step that is sure to move a timer by one tick of the default timer wheel
+static const auto TICK = std::chrono::milliseconds(10);
+
+// The client armed its timers, nothing happens until time moves.
+// Needed after every advance() that may have woken the client before the next one.
+static bool idle()
+{
+    return waitFor([]() { return SimulatedClock::pendingTimers() != 0; });
+}
+
+using SimulatedWheel = TimerWheel<SimulatedClock>;
+
+// Move time by ticks and run what became due. The wheels below run on an io_context of their own, driven by this thread.
+static void step(net::io_context &ioc, int ticks)
+{
+    SimulatedClock::advance(TICK * ticks);
+    ioc.restart();
+    ioc.poll();
+}
+
+// Timers due right before, on and after the boundaries of the wheel levels fire on their tick, wherever the wheel stood when they were scheduled
+static void wheelLevelBoundaries()
+{
+    static const int delays[] = { 1, 63, 64, 65, 127, 128, 4095, 4096, 4097, 262143, 262144, 262145 };
+    for (int offset : { 0, 37, 63 })
+    {
+        net::io_context ioc;
+        SimulatedWheel wheel(ioc, TICK);
+        std::vector<int> fired(std::size(delays));
+        std::vector<std::unique_ptr<SimulatedWheel::Timer>> timers;
+        step(ioc, offset);
+        for (std::size_t i = 0; i < std::size(delays); i++)
+        {
+            timers.push_back(std::make_unique<SimulatedWheel::Timer>(wheel));
+            timers.back()->schedule(TICK * delays[i], [&fired, i]() { fired[i]++; });
+        }
+        int elapsed = 0;
+        for (std::size_t i = 0; i < std::size(delays); i++)
+        {
+            step(ioc, delays[i] - 1 - elapsed);
+            CHECK(fired[i] == 0);
+            step(ioc, 1);
+            CHECK(fired[i] == 1);
+            elapsed = delays[i];
+        }
+        CHECK(std::all_of(fired.begin(), fired.end(), [](int count) { return count == 1; }));
+        CHECK(SimulatedClock::pendingTimers() == 0);
+    }
+}
+
+// Scheduling again replaces the deadline, an earlier one on a lower level included. Only the new callback runs, once.
+static void wheelRearmEarlier()
+{
+    net::io_context ioc;
+    SimulatedWheel wheel(ioc, TICK);
+    int first = 0, second = 0;
+    SimulatedWheel::Timer timer(wheel);
+    timer.schedule(TICK * 5000, [&first]() { first++; });
+    step(ioc, 10);
+    timer.schedule(TICK * 5, [&second]() { second++; });
+    step(ioc, 4);
+    CHECK(second == 0);
+    step(ioc, 1);
+    CHECK(second == 1);
+    step(ioc, 6000);
+    CHECK(first == 0);
+    CHECK(second == 1);
+    CHECK(SimulatedClock::pendingTimers() == 0);
+}
+
+// A timer cancelled after the driver completed, but before its handler ran, doesn't fire
+static void wheelCancelQueued()
+{
+    net::io_context ioc;
+    SimulatedWheel wheel(ioc, TICK);
+    int fired = 0;
+    SimulatedWheel::Timer timer(wheel);
+    timer.schedule(TICK * 5, [&fired]() { fired++; });
+    SimulatedClock::advance(TICK * 5);
+    // The driver's handler is queued on ioc now
+    CHECK(SimulatedClock::pendingTimers() == 0);
+    CHECK(timer.cancel());
+    ioc.restart();
+    ioc.poll();
+    CHECK(fired == 0);
+
+    // The stale wakeup left the wheel working
+    timer.schedule(TICK * 2, [&fired]() { fired++; });
+    step(ioc, 1);
+    CHECK(fired == 0);
+    step(ioc, 1);
+    CHECK(fired == 1);
+}
+
+// A refused first attempt is retried after exactly the restart delay
+static void reconnectAfterAdvance()
+{
+    Server server;
+    server.network.setReachable(false);
+    SimulatedWebSocketClient client(SimulatedTransport(server.network), "/api/v1/client", [](std::string) {});
+    client.start();
+    CHECK(server.network.connectionAttempts() == 1);
+    server.network.setReachable(true);
+
+    CHECK(idle());
+    SimulatedClock::advance(RESTART_DELAY - TICK);
+    CHECK(idle());
+    CHECK(server.network.connectionAttempts() == 1);
+    SimulatedClock::advance(TICK);
+    CHECK(waitFor([&]() { return server.accepted == 1; }));
+    CHECK(server.network.connectionAttempts() == 2);
+    client.stop();
+}
+
+// Dropped connections come back after the restart delay, messages queued while offline are sent then
+static void dropAll()
+{
+    Server server;
+    SimulatedWebSocketClient client(SimulatedTransport(server.network), "/api/v1/client", [](std::string) {});
+    client.start();
+    CHECK(waitFor([&]() { return server.accepted == 1; }));
+
+    for (int round = 0; round < 50; round++)
+    {
+        server.network.dropAll();
+        CHECK(idle());
+        CHECK(client.sendMessage("queued " + std::to_string(round), true));
+        SimulatedClock::advance(RESTART_DELAY - TICK);
+        CHECK(idle());
+        CHECK(server.accepted == round + 1);
+        SimulatedClock::advance(TICK);
+        CHECK(waitFor([&]() { return server.accepted == round + 2; }));
+        CHECK(waitFor([&]() { return server.receivedCount() == std::size_t(round + 1); }));
+    }
+    CHECK(server.network.connectionAttempts() == 51);
+    client.stop();
+}
+
+// Connecting takes the configured latency, not a moment less
+static void latency()
+{
+    Server server;
+    server.network.setConnectLatency(std::chrono::milliseconds(250));
+    SimulatedWebSocketClient client(SimulatedTransport(server.network), "/api/v1/client", [](std::string) {});
+    client.start(true);
+    CHECK(waitFor([&]() { return server.network.connectionAttempts() == 1; }));
+    SimulatedClock::advance(std::chrono::milliseconds(249));
+    CHECK(idle());
+    CHECK(server.accepted == 0);
+    SimulatedClock::advance(std::chrono::milliseconds(1));
+    CHECK(waitFor([&]() { return server.accepted == 1; }));
+
+    // Recovery after a drop is the restart delay plus the latency
+    server.network.dropAll();
+    CHECK(idle());
+    SimulatedClock::advance(RESTART_DELAY);
+    CHECK(waitFor([&]() { return server.network.connectionAttempts() == 2; }));
+    SimulatedClock::advance(std::chrono::milliseconds(249));
+    CHECK(idle());
+    CHECK(server.accepted == 1);
+    SimulatedClock::advance(std::chrono::milliseconds(1));
+    CHECK(waitFor([&]() { return server.accepted == 2; }));
+    client.stop();
+}
+
+// While partitioned every retry is refused, the first one after the partition heals gets through
+static void partition()
+{
+    Server server;
+    SimulatedWebSocketClient client(SimulatedTransport(server.network), "/api/v1/client", [](std::string) {});
+    client.start();
+    CHECK(waitFor([&]() { return server.accepted == 1; }));
+
+    server.network.setReachable(false);
+    server.network.dropAll();
+    for (int retry = 1; retry <= 5; retry++)
+    {
+        CHECK(idle());
+        SimulatedClock::advance(RESTART_DELAY);
+        CHECK(waitFor([&]() { return server.network.connectionAttempts() == std::size_t(1 + retry); }));
+    }
+    CHECK(server.accepted == 1);
+
+    server.network.setReachable(true);
+    CHECK(idle());
+    SimulatedClock::advance(RESTART_DELAY);
+    CHECK(waitFor([&]() { return server.accepted == 2; }));
+    CHECK(server.network.connectionAttempts() == 7);
+    client.stop();
+}
+
+// A stopped client doesn't retry, however far time moves
+static void stopCancelsRetry()
+{
+    Server server;
+    server.network.setReachable(false);
+    SimulatedWebSocketClient client(SimulatedTransport(server.network), "/api/v1/client", [](std::string) {});
+    client.start();
+    CHECK(idle());
+    client.stop();
+    server.network.setReachable(true);
+    SimulatedClock::advance(RESTART_DELAY * 10);
+    CHECK(server.network.connectionAttempts() == 1);
+    CHECK(server.accepted == 0);
+}
+
+// A server that never answers the handshake costs no wall time, stopping the client aborts the handshake at once
+static void silentServer()
+{
+    Server server;
+    server.answer = false;
+    auto begin = std::chrono::steady_clock::now();
+    {
+        SimulatedWebSocketClient client(SimulatedTransport(server.network), "/api/v1/client", [](std::string) {});
+        // A blocking start would wait for the handshake
+        client.start(true);
+        CHECK(waitFor([&]() { return server.network.connectionAttempts() == 1; }));
+        client.stop();
+    }
+    CHECK(std::chrono::steady_clock::now() - begin < std::chrono::seconds(1));
+    CHECK(server.accepted == 0);
+}
+
+// Settings changed while the handshake is running reach the server, although the handshake headers were built before
+static void changeDuringHandshake()
+{
+    Server server;
+    server.answer = false;
+    NullNexus nexus;
+    NullNexus::UserSettings settings;
+    settings.username = "user";
+    settings.colour   = 1;
+    nexus.changeData(settings);
+    nexus.connectTransport(SimulatedTransport(server.network), "/api/v1/client", true);
+    CHECK(waitFor([&]() { return server.heldCount() == 1; }));
+
+    NullNexus::UserSettings changed;
+    changed.colour = 2;
+    nexus.changeData(changed);
+    server.answerHeld();
+    CHECK(waitFor([&]() { return server.accepted == 1; }));
+    CHECK(waitFor([&]() {
+        std::lock_guard<std::mutex> lock(server.mutex);
+        return std::any_of(server.received.begin(), server.received.end(), [](const std::string &msg) { return msg.find("\"colour\":\"2\"") != std::string::npos; });
+    }));
+}
+
+// A fence without a connection waits for the next one instead of giving up
+static void fenceAcrossReconnect()
+{
+    Server server;
+    server.answer = false;
+    SimulatedWebSocketClient client(SimulatedTransport(server.network), "/api/v1/client", [](std::string) {});
+    client.start(true);
+    CHECK(waitFor([&]() { return server.heldCount() == 1; }));
+
+    std::atomic<int> reached{ 0 };
+    client.fence([&](bool read) { reached = read ? 1 : -1; });
+    server.network.dropAll();
+    CHECK(idle());
+    CHECK(reached == 0);
+    SimulatedClock::advance(RESTART_DELAY);
+    CHECK(waitFor([&]() { return server.heldCount() == 2; }));
+    CHECK(reached == 0);
+    server.answerHeld();
+    CHECK(waitFor([&]() { return reached != 0; }));
+    CHECK(reached == 1);
+    client.stop();
+}
+
+// A batch queued behind a fragmented message without sendIfOffline is dropped with the connection, not sent on the next one
+static void batchBehindStream()
+{
+    Server server;
+    SimulatedWebSocketClient client(SimulatedTransport(server.network), "/api/v1/client", [](std::string) {});
+    client.start();
+    CHECK(waitFor([&]() { return server.accepted == 1; }));
+
+    std::atomic<int> fragments{ 0 };
+    std::atomic<int> streamed{ 0 };
+    client.sendStream(
+        [&](std::string &chunk) {
+            chunk = "fragment";
+            fragments++;
+            return true;
+        },
+        [&](bool success) { streamed = success ? 1 : -1; });
+    CHECK(waitFor([&]() { return fragments > 0; }));
+    CHECK(client.sendBatch({ "batch 1", "batch 2" }));
+
+    server.network.dropAll();
+    CHECK(waitFor([&]() { return streamed != 0; }));
+    CHECK(streamed == -1);
+    CHECK(idle());
+    SimulatedClock::advance(RESTART_DELAY);
+    CHECK(waitFor([&]() { return server.accepted == 2; }));
+    CHECK(client.sendMessage("marker", true));
+    CHECK(waitFor([&]() { return server.receivedCount() == 1; }));
+    {
+        std::lock_guard<std::mutex> lock(server.mutex);
+        CHECK(server.received.front() == "marker");
+    }
+    client.stop();
+}
+
+static void runCase(const char *name, void (*scenario)(), int runs)
+{
+    int before = failures;
+    for (int run = 0; run < runs && failures == before; run++)
+        scenario();
+    std::cout << (failures == before ? "ok   " : "FAIL ") << name << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    int runs   = argc > 1 ? std::max(std::atoi(argv[1]), 1) : 40;
+    auto begin = std::chrono::steady_clock::now();
+    runCase("wheel level boundaries", wheelLevelBoundaries, runs);
+    runCase("wheel rearm earlier", wheelRearmEarlier, runs);
+    runCase("wheel cancel queued", wheelCancelQueued, runs);
+    runCase("reconnect after advance", reconnectAfterAdvance, runs);
+    runCase("drop all", dropAll, runs);
+    runCase("latency", latency, runs);
+    runCase("partition", partition, runs);
+    runCase("stop cancels retry", stopCancelsRetry, runs);
+    runCase("silent server", silentServer, runs);
+    runCase("change during handshake", changeDuringHandshake, runs);
+    runCase("fence across reconnect", fenceAcrossReconnect, runs);
+    runCase("batch behind stream", batchBehindStream, runs);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
+    std::cout << runs * 12 << " scenarios in " << elapsed.count() << " ms" << std::endl;
+    return failures ? 1 : 0;
+}